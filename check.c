@@ -97,14 +97,179 @@ static inline bool is_dir(const struct stat *status)
 	return file_type(status) == S_IFDIR;
 }
 
-static bool is_dir_xattr(int dirfd, const char *pathname,
-			 const char *xattrname)
+/*
+ * Lookup cache
+ *
+ * Both passes, and the lookups from every layer above, stat the same
+ * lower paths and read the same opaque and redirect xattrs over and
+ * over. Their results are kept for the whole run in two direct-mapped
+ * tables, so the memory used is bounded: a new result just replaces the
+ * one in its slot. Stat results are found by layer and path, the xattrs
+ * by the (dev, ino) of that stat, so every path of an inode shares them.
+ * The repairs drop what they change with ovl_cache_forget().
+ */
+#define OVL_CACHE_SLOTS		(1 << 14)
+
+#define OVL_CACHE_OPAQUE	0x1
+#define OVL_CACHE_REDIRECT	0x2
+
+struct ovl_stat_slot {
+	int dirfd;		/* layer of pathname */
+	char *pathname;		/* NULL if the slot is unused */
+	bool exist;
+	struct stat st;
+};
+
+struct ovl_inode_slot {
+	dev_t dev;
+	ino_t ino;
+	unsigned int known;	/* OVL_CACHE_* xattrs read already */
+	unsigned int set;	/* OVL_CACHE_* xattrs found */
+	char *redirect;		/* redirect xattr value, if any */
+	ssize_t redirect_len;
+};
+
+static struct ovl_stat_slot *stat_cache;
+static struct ovl_inode_slot *inode_cache;
+
+static unsigned int ovl_cache_hash_path(int dirfd, const char *pathname)
+{
+	unsigned int hash = 2166136261u ^ (unsigned int)dirfd;
+
+	while (*pathname)
+		hash = (hash ^ (unsigned char)*pathname++) * 16777619u;
+	return hash % OVL_CACHE_SLOTS;
+}
+
+static unsigned int ovl_cache_hash_inode(dev_t dev, ino_t ino)
+{
+	unsigned long long key = (unsigned long long)ino * 31 + dev;
+
+	return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 40) %
+		OVL_CACHE_SLOTS;
+}
+
+static struct ovl_stat_slot *ovl_cache_stat_slot(int dirfd,
+						 const char *pathname)
+{
+	if (!stat_cache) {
+		stat_cache = smalloc(OVL_CACHE_SLOTS * sizeof(*stat_cache));
+		memset(stat_cache, 0, OVL_CACHE_SLOTS * sizeof(*stat_cache));
+	}
+	return &stat_cache[ovl_cache_hash_path(dirfd, pathname)];
+}
+
+static void ovl_cache_drop_inode(const struct stat *st)
+{
+	struct ovl_inode_slot *slot;
+
+	if (!inode_cache)
+		return;
+
+	slot = &inode_cache[ovl_cache_hash_inode(st->st_dev, st->st_ino)];
+	if (slot->known && slot->dev == st->st_dev && slot->ino == st->st_ino) {
+		free(slot->redirect);
+		memset(slot, 0, sizeof(*slot));
+	}
+}
+
+/*
+ * Drop the cached stat of pathname in dirfd and the cached xattrs of its
+ * inode, before a repair changes either of them.
+ */
+static void ovl_cache_forget(int dirfd, const char *pathname)
+{
+	struct ovl_stat_slot *slot = ovl_cache_stat_slot(dirfd, pathname);
+	struct stat st;
+
+	if (slot->pathname && slot->dirfd == dirfd &&
+	    !strcmp(slot->pathname, pathname)) {
+		free(slot->pathname);
+		slot->pathname = NULL;
+	}
+	if (!fstatat(dirfd, pathname, &st, AT_SYMLINK_NOFOLLOW))
+		ovl_cache_drop_inode(&st);
+}
+
+static void ovl_cache_free(void)
+{
+	int i;
+
+	for (i = 0; stat_cache && i < OVL_CACHE_SLOTS; i++)
+		free(stat_cache[i].pathname);
+	for (i = 0; inode_cache && i < OVL_CACHE_SLOTS; i++)
+		free(inode_cache[i].redirect);
+	free(stat_cache);
+	free(inode_cache);
+	stat_cache = NULL;
+	inode_cache = NULL;
+}
+
+/*
+ * Lookup a specified target exist or not, return the stat struct if exist
+ */
+static int ovl_lookup_single(int dirfd, const char *pathname,
+			     struct stat *st, bool *exist)
+{
+	struct ovl_stat_slot *slot = ovl_cache_stat_slot(dirfd, pathname);
+
+	if (slot->pathname && slot->dirfd == dirfd &&
+	    !strcmp(slot->pathname, pathname)) {
+		*exist = slot->exist;
+		if (slot->exist)
+			*st = slot->st;
+		return 0;
+	}
+
+	if (fstatat(dirfd, pathname, st,
+		    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		if (errno != ENOENT && errno != ENOTDIR) {
+			print_err(_("Cannot stat %s: %s\n"), pathname,
+				    strerror(errno));
+			return -1;
+		}
+		*exist = false;
+	} else {
+		*exist = true;
+	}
+
+	free(slot->pathname);
+	slot->dirfd = dirfd;
+	slot->pathname = sstrdup(pathname);
+	slot->exist = *exist;
+	if (*exist)
+		slot->st = *st;
+	return 0;
+}
+
+/* Cached xattrs of the inode at pathname in dirfd, NULL if not there */
+static struct ovl_inode_slot *ovl_cache_inode(int dirfd, const char *pathname)
+{
+	struct ovl_inode_slot *slot;
+	struct stat st;
+	bool exist;
+
+	if (ovl_lookup_single(dirfd, pathname, &st, &exist) || !exist)
+		return NULL;
+
+	if (!inode_cache) {
+		inode_cache = smalloc(OVL_CACHE_SLOTS * sizeof(*inode_cache));
+		memset(inode_cache, 0, OVL_CACHE_SLOTS * sizeof(*inode_cache));
+	}
+	slot = &inode_cache[ovl_cache_hash_inode(st.st_dev, st.st_ino)];
+	if (slot->dev != st.st_dev || slot->ino != st.st_ino) {
+		free(slot->redirect);
+		memset(slot, 0, sizeof(*slot));
+		slot->dev = st.st_dev;
+		slot->ino = st.st_ino;
+	}
+	return slot;
+}
+
+static bool is_xattr_set(ssize_t ret, char *val)
 {
-	char *val = NULL;
-	ssize_t ret;
 	bool exist;
 
-	ret = get_xattr(dirfd, pathname, xattrname, &val, NULL);
 	if (ret <= 0 || !val)
 		return false;
 
@@ -113,24 +278,61 @@ static bool is_dir_xattr(int dirfd, const char *pathname,
 	return exist;
 }
 
-static inline bool ovl_is_opaque(int dirfd, const char *pathname)
+static bool is_dir_xattr(int dirfd, const char *pathname,
+			 const char *xattrname)
+{
+	char *val = NULL;
+	ssize_t ret;
+
+	ret = get_xattr(dirfd, pathname, xattrname, &val, NULL);
+	return is_xattr_set(ret, val);
+}
+
+/* Same as is_dir_xattr() for the entry being scanned */
+static bool is_entry_xattr(struct scan_ctx *sctx, const char *xattrname)
 {
-	return is_dir_xattr(dirfd, pathname, OVL_OPAQUE_XATTR);
+	char *val = NULL;
+	ssize_t ret;
+
+	ret = scan_get_xattr(sctx, xattrname, &val, NULL);
+	return is_xattr_set(ret, val);
+}
+
+static bool ovl_is_opaque(int dirfd, const char *pathname)
+{
+	struct ovl_inode_slot *slot = ovl_cache_inode(dirfd, pathname);
+
+	if (!slot)
+		return is_dir_xattr(dirfd, pathname, OVL_OPAQUE_XATTR);
+
+	if (!(slot->known & OVL_CACHE_OPAQUE)) {
+		if (is_dir_xattr(dirfd, pathname, OVL_OPAQUE_XATTR))
+			slot->set |= OVL_CACHE_OPAQUE;
+		slot->known |= OVL_CACHE_OPAQUE;
+	}
+	return slot->set & OVL_CACHE_OPAQUE;
+}
+
+static inline bool ovl_entry_is_opaque(struct scan_ctx *sctx)
+{
+	return is_entry_xattr(sctx, OVL_OPAQUE_XATTR);
 }
 
 static inline int ovl_remove_opaque(int dirfd, const char *pathname)
 {
+	ovl_cache_forget(dirfd, pathname);
 	return remove_xattr(dirfd, pathname, OVL_OPAQUE_XATTR);
 }
 
 static inline int ovl_set_opaque(int dirfd, const char *pathname)
 {
+	ovl_cache_forget(dirfd, pathname);
 	return set_xattr(dirfd, pathname, OVL_OPAQUE_XATTR, "y", 1);
 }
 
-static inline int ovl_is_impure(int dirfd, const char *pathname)
+static inline int ovl_entry_is_impure(struct scan_ctx *sctx)
 {
-	return is_dir_xattr(dirfd, pathname, OVL_IMPURE_XATTR);
+	return is_entry_xattr(sctx, OVL_IMPURE_XATTR);
 }
 
 static inline int ovl_set_impure(int dirfd, const char *pathname)
@@ -138,13 +340,10 @@ static inline int ovl_set_impure(int dirfd, const char *pathname)
 	return set_xattr(dirfd, pathname, OVL_IMPURE_XATTR, "y", 1);
 }
 
-static int ovl_get_redirect(int dirfd, const char *pathname,
-			    char **redirect)
+/* Turn redirect xattr rd of ret bytes into a path from the overlay root */
+static int ovl_parse_redirect(const char *pathname, char *rd, ssize_t ret,
+			      char **redirect)
 {
-	char *rd = NULL;
-	ssize_t ret;
-
-	ret = get_xattr(dirfd, pathname, OVL_REDIRECT_XATTR, &rd, NULL);
 	if (ret <= 0 || !rd)
 		return ret;
 
@@ -164,13 +363,69 @@ static int ovl_get_redirect(int dirfd, const char *pathname,
 	return 0;
 }
 
+/* Read the redirect xattr of pathname into its inode slot, if not yet */
+static int ovl_cache_redirect(struct ovl_inode_slot *slot, int dirfd,
+			      const char *pathname)
+{
+	char *rd = NULL;
+	bool exist = false;
+	ssize_t ret;
+
+	if (slot->known & OVL_CACHE_REDIRECT)
+		return 0;
+
+	ret = get_xattr(dirfd, pathname, OVL_REDIRECT_XATTR, &rd, &exist);
+	if (ret < 0)
+		return ret;
+
+	slot->redirect = rd;
+	slot->redirect_len = ret;
+	if (exist)
+		slot->set |= OVL_CACHE_REDIRECT;
+	slot->known |= OVL_CACHE_REDIRECT;
+	return 0;
+}
+
+static int ovl_get_redirect(int dirfd, const char *pathname,
+			    char **redirect)
+{
+	struct ovl_inode_slot *slot = ovl_cache_inode(dirfd, pathname);
+	char *rd = NULL;
+	ssize_t ret;
+
+	if (!slot) {
+		ret = get_xattr(dirfd, pathname, OVL_REDIRECT_XATTR, &rd, NULL);
+		return ovl_parse_redirect(pathname, rd, ret, redirect);
+	}
+
+	ret = ovl_cache_redirect(slot, dirfd, pathname);
+	if (ret || !slot->redirect)
+		return ret;
+
+	/* ovl_parse_redirect() takes over the copy */
+	rd = smalloc(slot->redirect_len + 1);
+	memcpy(rd, slot->redirect, slot->redirect_len + 1);
+	return ovl_parse_redirect(pathname, rd, slot->redirect_len, redirect);
+}
+
+static int ovl_entry_get_redirect(struct scan_ctx *sctx, char **redirect)
+{
+	char *rd = NULL;
+	ssize_t ret;
+
+	ret = scan_get_xattr(sctx, OVL_REDIRECT_XATTR, &rd, NULL);
+	return ovl_parse_redirect(sctx->pathname, rd, ret, redirect);
+}
+
 static inline int ovl_remove_redirect(int dirfd, const char *pathname)
 {
+	ovl_cache_forget(dirfd, pathname);
 	return remove_xattr(dirfd, pathname, OVL_REDIRECT_XATTR);
 }
 
 static inline int ovl_create_whiteout(int dirfd, const char *pathname)
 {
+	ovl_cache_forget(dirfd, pathname);
 	if (mknodat(dirfd, pathname, S_IFCHR | WHITEOUT_MOD, makedev(0, 0))) {
 		print_err(_("Cannot mknod %s:%s\n"), pathname,
 			    strerror(errno));
@@ -181,15 +436,29 @@ static inline int ovl_create_whiteout(int dirfd, const char *pathname)
 
 static inline bool ovl_is_redirect(int dirfd, const char *pathname)
 {
+	struct ovl_inode_slot *slot = ovl_cache_inode(dirfd, pathname);
 	bool exist = false;
-	get_xattr(dirfd, pathname, OVL_REDIRECT_XATTR, NULL, &exist);
+
+	if (!slot) {
+		get_xattr(dirfd, pathname, OVL_REDIRECT_XATTR, NULL, &exist);
+		return exist;
+	}
+	if (ovl_cache_redirect(slot, dirfd, pathname))
+		return false;
+	return slot->set & OVL_CACHE_REDIRECT;
+}
+
+static inline bool ovl_entry_is_redirect(struct scan_ctx *sctx)
+{
+	bool exist = false;
+	scan_get_xattr(sctx, OVL_REDIRECT_XATTR, NULL, &exist);
 	return exist;
 }
 
-static inline bool ovl_is_origin(int dirfd, const char *pathname)
+static inline bool ovl_entry_is_origin(struct scan_ctx *sctx)
 {
 	bool exist = false;
-	get_xattr(dirfd, pathname, OVL_ORIGIN_XATTR, NULL, &exist);
+	scan_get_xattr(sctx, OVL_ORIGIN_XATTR, NULL, &exist);
 	return exist;
 }
 
@@ -221,26 +490,6 @@ static inline int ovl_ask_question(const char *question, const char *pathname,
 	return ask_question("", action);
 }
 
-/*
- * Lookup a specified target exist or not, return the stat struct if exist
- */
-static int ovl_lookup_single(int dirfd, const char *pathname,
-			     struct stat *st, bool *exist)
-{
-	if (fstatat(dirfd, pathname, st,
-		    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
-		if (errno != ENOENT && errno != ENOTDIR) {
-			print_err(_("Cannot stat %s: %s\n"), pathname,
-				    strerror(errno));
-			return -1;
-		}
-		*exist = false;
-	} else {
-		*exist = true;
-	}
-	return 0;
-}
-
 /*
  * Lookup a specified target exist or not in a specified layer.
  * If not exist, we may want to scan the next layer, so iterate to the
@@ -439,6 +688,7 @@ remove:
 			    layer->stack, "Remove", 1))
 		return 0;
 
+	ovl_cache_forget(layer->fd, pathname);
 	ret = unlinkat(layer->fd, pathname, 0);
 	if (ret) {
 		print_err(_("Cannot unlink %s: %s\n"), pathname,
@@ -669,7 +919,7 @@ static int ovl_check_redirect(struct scan_ctx *sctx)
 	int ret;
 
 	/* Get redirect */
-	ret = ovl_get_redirect(layer->fd, pathname, &redirect);
+	ret = ovl_entry_get_redirect(sctx, &redirect);
 	if (ret || !redirect)
 		return ret;
 
@@ -796,7 +1046,7 @@ static int ovl_check_impure(struct scan_ctx *sctx)
 	    !dirdata->redirects)
 		return 0;
 
-	if (ovl_is_impure(layer->fd, sctx->pathname))
+	if (ovl_entry_is_impure(sctx))
 		return 0;
 
 	/* Fix impure xattrs */
@@ -820,15 +1070,15 @@ static int ovl_check_impure(struct scan_ctx *sctx)
 	return 0;
 }
 
-static inline bool ovl_is_merge(const struct ovl_fs *ofs,
-				const struct ovl_layer *layer,
-				const char *pathname)
+static inline bool ovl_is_merge(struct scan_ctx *sctx)
 {
+	const struct ovl_layer *layer = sctx->layer;
 	struct ovl_lookup_data od = {0};
 
-	if (ovl_is_opaque(layer->fd, pathname))
+	if (ovl_entry_is_opaque(sctx))
 		return false;
-	if (ovl_lookup_lower(ofs, pathname, layer->type, layer->stack, &od))
+	if (ovl_lookup_lower(sctx->ofs, sctx->pathname, layer->type,
+			     layer->stack, &od))
 		return false;
 	if (od.exist && is_dir(&od.st))
 		return true;
@@ -842,20 +1092,18 @@ static inline bool ovl_is_merge(const struct ovl_fs *ofs,
  */
 static int ovl_count_impurity(struct scan_ctx *sctx)
 {
-	const struct ovl_fs *ofs = sctx->ofs;
-	const struct ovl_layer *layer = sctx->layer;
 	struct scan_dir_data *parent = sctx->dirdata;
 
 	if (!parent)
 		return 0;
 
-	if (ovl_is_origin(layer->fd, sctx->pathname))
+	if (ovl_entry_is_origin(sctx))
 		parent->origins++;
 
 	if (is_dir(sctx->st)) {
-		if (ovl_is_redirect(layer->fd, sctx->pathname))
+		if (ovl_entry_is_redirect(sctx))
 			parent->redirects++;
-		if (ovl_is_merge(ofs, layer, sctx->pathname))
+		if (ovl_is_merge(sctx))
 			parent->mergedirs++;
 	}
 
@@ -881,6 +1129,7 @@ static void ovl_scan_clean(void)
 {
 	/* Clean redirect entry record */
 	ovl_redirect_free();
+	ovl_cache_free();
 }
 
 static void ovl_scan_report(struct scan_result *result)
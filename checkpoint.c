@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "overlayfs-tools checkpoint 3"
+
+// strings are written as <length>:<bytes>, as names may contain anything but '/' and NUL
+static int write_string(FILE *f, const char *key, const char *value) {
+    return (fprintf(f, "%s %zu:%s\n", key, strlen(value), value) < 0) ? -1 : 0;
+}
+
+// reads a string written by write_string(), returns NULL unless its key is the expected one
+static char *read_string(FILE *f, const char *key) {
+    char word[16];
+    size_t len;
+    if (fscanf(f, " %15s %zu:", word, &len) != 2 || strcmp(word, key) != 0 || len > 1 << 20) { return NULL; }
+    char *value = malloc(len + 1);
+    if (value == NULL) { return NULL; }
+    if (fread(value, 1, len, f) != len || fgetc(f) != '\n' || memchr(value, '\0', len) != NULL) {
+        free(value);
+        return NULL;
+    }
+    value[len] = '\0';
+    return value;
+}
+
+int checkpoint_write(const char *path, const struct checkpoint *cp) {
+    size_t len = strlen(path);
+    char *tmp_path = malloc(len + 5);
+    if (tmp_path == NULL) { return -1; }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) { free(tmp_path); return -1; }
+    int return_val = 0;
+    if (fprintf(f, "%s\n", CHECKPOINT_MAGIC) < 0
+        || write_string(f, "action", cp->action) < 0
+        || write_string(f, "lowerdir", cp->lowerdir) < 0
+        || write_string(f, "upperdir", cp->upperdir) < 0
+        || write_string(f, "output", cp->output) < 0
+        || fprintf(f, "merge-join %d\nmemory-limit %zu\nverbose %d\nbrief %d\noffset %lld\ndepth %zu\n",
+                   cp->merge_join, cp->memory_limit, cp->verbose, cp->brief, (long long) cp->offset, cp->depth) < 0) {
+        return_val = -1;
+    }
+    for (size_t i = 0; return_val == 0 && i < cp->depth; i++) {
+        if (fprintf(f, "index %d\n", cp->index[i]) < 0 || write_string(f, "name", cp->name[i]) < 0) { return_val = -1; }
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) { return_val = -1; }
+    if (fclose(f) != 0) { return_val = -1; }
+    if (return_val == 0 && rename(tmp_path, path) != 0) { return_val = -1; }
+    if (return_val != 0) { unlink(tmp_path); }
+    free(tmp_path);
+    return return_val;
+}
+
+int checkpoint_read(const char *path, struct checkpoint *cp) {
+    memset(cp, 0, sizeof(struct checkpoint));
+    FILE *f = fopen(path, "r");
+    if (f == NULL) { return -1; }
+    char magic[sizeof(CHECKPOINT_MAGIC) + 1];
+    int merge_join, verbose, brief;
+    long long offset;
+    if (fgets(magic, sizeof(magic), f) == NULL || strcmp(magic, CHECKPOINT_MAGIC "\n") != 0) { goto fail; }
+    if ((cp->action = read_string(f, "action")) == NULL) { goto fail; }
+    if ((cp->lowerdir = read_string(f, "lowerdir")) == NULL) { goto fail; }
+    if ((cp->upperdir = read_string(f, "upperdir")) == NULL) { goto fail; }
+    if ((cp->output = read_string(f, "output")) == NULL) { goto fail; }
+    if (fscanf(f, "merge-join %d memory-limit %zu verbose %d brief %d offset %lld depth %zu ", &merge_join, &cp->memory_limit, &verbose, &brief, &offset, &cp->depth) != 6
+        || offset < 0 || cp->depth > 1 << 16) { goto fail; }
+    cp->merge_join = merge_join;
+    cp->verbose = verbose;
+    cp->brief = brief;
+    cp->offset = (off_t) offset;
+    cp->index = calloc(cp->depth + 1, sizeof(int));
+    cp->name = calloc(cp->depth + 1, sizeof(char *));
+    if (cp->index == NULL || cp->name == NULL) { goto fail; }
+    for (size_t i = 0; i < cp->depth; i++) {
+        if (fscanf(f, "index %d ", &cp->index[i]) != 1 || cp->index[i] < 0) { goto fail; }
+        if ((cp->name[i] = read_string(f, "name")) == NULL) { goto fail; }
+    }
+    fclose(f);
+    return 0;
+fail:
+    fclose(f);
+    checkpoint_free(cp);
+    return -1;
+}
+
+void checkpoint_free(struct checkpoint *cp) {
+    free(cp->action);
+    free(cp->lowerdir);
+    free(cp->upperdir);
+    free(cp->output);
+    if (cp->name != NULL) {
+        for (size_t i = 0; i < cp->depth; i++) { free(cp->name[i]); }
+    }
+    free(cp->name);
+    free(cp->index);
+    memset(cp, 0, sizeof(struct checkpoint));
+}
@@ -0,0 +1,47 @@
+/*
+ * checkpoint.h / checkpoint.c
+ *
+ * the checkpoint file of a long running action: where the traversal was, and how much output it had written by then
+ */
+
+#ifndef OVERLAYFS_TOOLS_CHECKPOINT_H
+#define OVERLAYFS_TOOLS_CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct checkpoint {
+    char *action;
+    char *lowerdir;
+    char *upperdir;
+    char *output; // absolute path of the script, or "-" for the standard output of diff
+    // the options that decide the order the entries are visited in: merge-join mode, and the memory limit under
+    // which it streams the directories too wide to be joined
+    bool merge_join;
+    size_t memory_limit;
+    // the output format (-v, -b), so a resumed run appends in the same one
+    bool verbose;
+    bool brief;
+    off_t offset; // of the output, up to the cursor
+    // the cursor: one level per directory from the top. every level but the last is a directory in progress, its
+    // index and name are those of the directory. the last level is the next entry to visit, the name is that of the
+    // entry before it (the last one completed), to check the directory has not changed since
+    size_t depth;
+    int *index;
+    char **name;
+};
+
+/*
+ * returns 0 on success. writes to a temporary file renamed over path, so a crash leaves the previous checkpoint
+ */
+int checkpoint_write(const char *path, const struct checkpoint *cp);
+
+/*
+ * returns 0 on success, -1 if path cannot be read or is not a checkpoint. free the result with checkpoint_free()
+ */
+int checkpoint_read(const char *path, struct checkpoint *cp);
+
+void checkpoint_free(struct checkpoint *cp);
+
+#endif //OVERLAYFS_TOOLS_CHECKPOINT_H
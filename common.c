@@ -117,3 +117,24 @@ void version(void)
 {
 	printf(_("OverlayFS Tools version %s\n"), OVERLAYFS_TOOLS_VERSION);
 }
+
+int parse_size(const char *str, uint64_t max, uint64_t *output)
+{
+	unsigned long long value;
+	int shift = 0;
+	char *end;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno || end == str || *str == '-')
+		return -1;
+	switch (*end) {
+	case 'K': case 'k': shift = 10; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'G': case 'g': shift = 30; end++; break;
+	}
+	if (*end || value > (max >> shift))
+		return -1;
+	*output = (uint64_t)value << shift;
+	return 0;
+}
@@ -19,6 +19,8 @@
 #ifndef OVL_COMMON_H
 #define OVL_COMMON_H
 
+#include <stdint.h>
+
 #ifndef __attribute__
 # if !defined __GNUC__ || __GNUC__ < 2 || (__GNUC__ == 2 && __GNUC_MINOR__ < 8) || __STRICT_ANSI__
 #  define __attribute__(x)
@@ -66,4 +68,10 @@ char *sstrndup(const char *src, size_t num);
 /* Print program version */
 void version(void);
 
+/*
+ * Parse a number with an optional K, M or G suffix (1024 based) into
+ * *output, which must not exceed max. Returns -1 if it is not one.
+ */
+int parse_size(const char *str, uint64_t max, uint64_t *output);
+
 #endif /* OVL_COMMON_H */
@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "compare.h"
+#include "uncached.h"
+#include "uring.h"
+#include "device.h"
+#include "throttle.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define ROUND_UP(X,A) (((X) + (A) - 1) / (A) * (A))
+
+// smaller files are cheaper to read than to map
+#define MAP_MIN_SIZE ((off_t) 256 << 10)
+// how much of each file is mapped at a time, so even 32-bit builds can compare huge files with many jobs
+#define MAP_WINDOW ((off_t) 16 << 20)
+#define READ_BUFFER_SIZE ((size_t) 1 << 20)
+// chunks of a file in flight at most, however many the disk takes
+#define PIPELINE_MAX_DEPTH 8
+// the ranges a large file is split into, small enough that a mismatch stops the other threads soon
+#define SPLIT_CHUNK ((off_t) 16 << 20)
+// below this, reading the files costs about as much as asking where their data is
+#define EXTENT_MIN_SIZE ((off_t) 64 << 10)
+#define EXTENT_BATCH 32
+/*
+ * files this large have a few blocks compared before they are read through: files rewritten in place (logs, databases,
+ * configs) mostly differ near their end, or here and there, while their start is compared first anyway
+ */
+#define SAMPLE_MIN_SIZE ((off_t) 64 << 20)
+#define SAMPLE_BLOCK ((size_t) 64 << 10)
+#define SAMPLE_COUNT 4 // besides the last block
+// extents whose physical address does not say where the data is, or not all of it
+#define EXTENT_OPAQUE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED \
+    | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)
+
+/*
+ * the equality loop: 128 bytes per step, xor-ed and or-ed together so there is a single branch per step. the vector
+ * type is lowered to whatever the target has (two SSE2 or NEON registers, one AVX2 register). on x86-64 with glibc
+ * an AVX2 clone is picked at run time, unless the whole build targets AVX2 anyway
+ */
+typedef uint64_t block_t __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) && defined(__GLIBC__) && defined(__GNUC__) && !defined(__clang__) && !defined(__AVX2__)
+#define COMPARE_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define COMPARE_CLONES
+#endif
+
+COMPARE_CLONES
+static bool blocks_equal(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 4 * sizeof(block_t) <= len; i += 4 * sizeof(block_t)) {
+        block_t x[4], y[4];
+        memcpy(x, a + i, sizeof(x)); // unaligned loads
+        memcpy(y, b + i, sizeof(y));
+        block_t d = (x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3]);
+        if ((d[0] | d[1] | d[2] | d[3]) != 0) { return false; }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+/*
+ * touching a mapped page raises SIGBUS if the file was truncated meanwhile, or the page cannot be read. the handler
+ * jumps back out of blocks_equal() to where the thread set fault_jump, and the read path takes over from there
+ */
+static __thread sigjmp_buf *fault_jump;
+static pthread_once_t fault_once = PTHREAD_ONCE_INIT;
+static bool fault_handled;
+
+static void fault_handler(int sig) {
+    if (fault_jump != NULL) { siglongjmp(*fault_jump, 1); }
+    signal(sig, SIG_DFL); // not ours
+    raise(sig);
+}
+
+static void fault_install(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fault_handler;
+    sigemptyset(&sa.sa_mask);
+    fault_handled = (sigaction(SIGBUS, &sa, NULL) == 0);
+}
+
+// returns 1 if the files differ, 0 if they are identical up to end, -1 if the read path has to go on from *offset
+static int compare_mapped(int lower_file, int upper_file, off_t *offset, off_t end) {
+    pthread_once(&fault_once, fault_install);
+    if (!fault_handled) { return -1; }
+    *offset &= ~((off_t) sysconf(_SC_PAGESIZE) - 1); // mappings start on a page, comparing a few bytes more does no harm
+    while (*offset < end) {
+        size_t len = (size_t) MIN(end - *offset, MAP_WINDOW);
+        void *lower_map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, lower_file, *offset);
+        if (lower_map == MAP_FAILED) { return -1; }
+        void *upper_map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, upper_file, *offset);
+        if (upper_map == MAP_FAILED) {
+            munmap(lower_map, len);
+            return -1;
+        }
+        madvise(lower_map, len, MADV_SEQUENTIAL);
+        madvise(upper_map, len, MADV_SEQUENTIAL);
+        throttle(len); // the pages fault in as they are compared
+        throttle(len);
+        sigjmp_buf jump;
+        volatile int equal = -1; // stays -1 if a page faulted
+        if (sigsetjmp(jump, 1) == 0) {
+            fault_jump = &jump;
+            equal = blocks_equal(lower_map, upper_map, len);
+        }
+        fault_jump = NULL;
+        munmap(lower_map, len);
+        munmap(upper_map, len);
+        if (equal < 0) { return -1; } // the read path tells which file, and why
+        if (!equal) { return 1; }
+        *offset += (off_t) len;
+    }
+    return 0;
+}
+
+// reads until len bytes or EOF, returns how many were read or -1
+static ssize_t read_full(int fd, char *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        throttle(len - done);
+        ssize_t ret = uncached_pread(fd, buf + done, len - done, offset + (off_t) done);
+        if (ret == 0) { break; }
+        if (ret < 0) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        done += (size_t) ret;
+        // O_DIRECT reads end off alignment only at EOF, and going on from there would be refused
+        if (uncached_enabled() && (offset + (off_t) done) % UNCACHED_ALIGN != 0) { break; }
+    }
+    return (ssize_t) done;
+}
+
+// passes on to feed what it has not had yet of [offset, offset + len) of the upper file, or gives up on it past a gap
+static void feed_upper(struct compare_feed *feed, const char *data, off_t offset, size_t len) {
+    if (feed == NULL || feed->next < 0) { return; }
+    if (offset > feed->next) {
+        feed->next = -1;
+        return;
+    }
+    size_t skip = (size_t) (feed->next - offset);
+    if (skip >= len) { return; }
+    feed->fn(feed->arg, data + skip, len - skip);
+    feed->next = offset + (off_t) len;
+}
+
+/*
+ * how the two files of a pair are read: each through its own queue in the read pipeline, as deep as the disk under it
+ * takes. files on two disks are read at the same time that way, while mapped, the pages fault in one file after the
+ * other
+ */
+struct readers {
+    int depth[2]; // chunks of the lower and the upper file read ahead of the comparison
+    bool apart; // on different disks: not mapped, unless cached already
+};
+
+static const struct readers default_readers = { .depth = { 2, 2 }, .apart = false };
+
+/*
+ * the read pipeline: chunks of each file are read through io_uring, up to depth of them ahead of the one compared, so
+ * neither file waits for the comparison or for the other file
+ */
+struct pipeline {
+    int files[2]; // lower, upper
+    int depth[2];
+    char *buffer[2]; // room for depth chunks of each file, chunk k goes to slot k % depth
+    off_t offset; // of chunk 0
+    off_t end;
+    size_t chunk;
+    off_t queued[2]; // chunks of each file queued so far
+    int res[2][PIPELINE_MAX_DEPTH]; // of the reads, -ECANCELED if one could not be queued
+    bool done[2][PIPELINE_MAX_DEPTH];
+    int pending; // reads in flight
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static bool ring_keyed;
+static __thread bool ring_unavailable;
+
+static void ring_free(void *ring) {
+    uring_destroy(ring);
+}
+
+static void ring_key_create(void) {
+    ring_keyed = (pthread_key_create(&ring_key, ring_free) == 0);
+}
+
+// the ring of this thread for the pipeline, NULL without io_uring
+static struct uring *pipeline_ring(void) {
+    if (ring_unavailable) { return NULL; }
+    pthread_once(&ring_once, ring_key_create);
+    struct uring *ring = ring_keyed ? pthread_getspecific(ring_key) : NULL;
+    if (ring == NULL) {
+        ring = ring_keyed ? uring_create(2 * PIPELINE_MAX_DEPTH) : NULL;
+        if (ring == NULL || pthread_setspecific(ring_key, ring) != 0) {
+            uring_destroy(ring);
+            ring_unavailable = true;
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+static void pipeline_complete(void *arg, uint64_t user_data, int res) {
+    struct pipeline *p = arg;
+    int f = (int) (user_data / PIPELINE_MAX_DEPTH);
+    int slot = (int) (user_data % PIPELINE_MAX_DEPTH);
+    p->res[f][slot] = res;
+    p->done[f][slot] = true;
+    p->pending--;
+}
+
+static off_t chunk_offset(const struct pipeline *p, off_t k) {
+    return p->offset + k * (off_t) p->chunk;
+}
+
+static size_t chunk_size(const struct pipeline *p, off_t k) {
+    return (size_t) MIN(p->end - chunk_offset(p, k), (off_t) p->chunk);
+}
+
+static char *chunk_buffer(const struct pipeline *p, int f, off_t k) {
+    return p->buffer[f] + (size_t) (k % p->depth[f]) * p->chunk;
+}
+
+// queues the read of the next chunk of file f
+static void pipeline_queue(struct uring *ring, struct pipeline *p, int f) {
+    off_t k = p->queued[f]++;
+    int slot = (int) (k % p->depth[f]);
+    size_t want = chunk_size(p, k);
+    size_t len = uncached_enabled() ? ROUND_UP(want, UNCACHED_ALIGN) : want;
+    p->done[f][slot] = false;
+    throttle(len);
+    if (uring_read(ring, p->files[f], chunk_buffer(p, f, k), len, chunk_offset(p, k), (uint64_t) (f * PIPELINE_MAX_DEPTH + slot)) == 0) {
+        p->pending++;
+    } else {
+        p->res[f][slot] = -ECANCELED;
+        p->done[f][slot] = true;
+    }
+}
+
+// reads what the ring did not of chunk k, a short read or one that failed (e.g. a kernel without IORING_OP_READ) again
+static int pipeline_finish(struct pipeline *p, off_t k) {
+    size_t want = chunk_size(p, k);
+    for (int f = 0; f < 2; f++) {
+        int res = p->res[f][k % p->depth[f]];
+        size_t done = (res > 0) ? (size_t) res : 0;
+        uncached_count(done);
+        if (done < want) {
+            ssize_t ret = read_full(p->files[f], chunk_buffer(p, f, k) + done, want - done, chunk_offset(p, k) + (off_t) done);
+            if (ret < 0) { return (f == 0) ? LOWER_READ_ERROR : UPPER_READ_ERROR; }
+            if (done + (size_t) ret < want) { return SIZE_MISMATCH; } // shrunk since the sizes were checked
+        }
+    }
+    return COMPARED;
+}
+
+// waits for the reads still in flight, so the buffers can be freed. a ring failing meanwhile has waited for them too
+static void pipeline_drain(struct uring *ring, struct pipeline *p) {
+    while (p->pending > 0) {
+        if (uring_wait(ring, 1, pipeline_complete, p) < 0) { return; }
+    }
+}
+
+static int compare_sequential(int lower_file, int upper_file, off_t offset, off_t end, struct compare_feed *feed, bool *output);
+
+/*
+ * compares [offset, end) of both files through the pipeline, in READ_BUFFER_SIZE chunks: larger ones were not read
+ * any faster, and fall out of the CPU caches before they are compared
+ */
+static int compare_pipelined(struct uring *ring, int lower_file, int upper_file, off_t offset, off_t end, const struct readers *readers, struct compare_feed *feed, bool *output) {
+    struct pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.files[0] = lower_file;
+    p.files[1] = upper_file;
+    p.offset = offset;
+    p.end = end;
+    p.chunk = ROUND_UP((size_t) MIN(end - offset, (off_t) READ_BUFFER_SIZE), UNCACHED_ALIGN);
+    for (int f = 0; f < 2; f++) { p.depth[f] = MAX(1, MIN(readers->depth[f], PIPELINE_MAX_DEPTH)); }
+    char *buffers;
+    if (posix_memalign((void **) &buffers, UNCACHED_ALIGN, (size_t) (p.depth[0] + p.depth[1]) * p.chunk) != 0) { return LOWER_READ_ERROR; }
+    p.buffer[0] = buffers;
+    p.buffer[1] = buffers + (size_t) p.depth[0] * p.chunk;
+    off_t chunks = (end - offset + (off_t) p.chunk - 1) / (off_t) p.chunk;
+    int return_val = COMPARED;
+    *output = true;
+    for (off_t k = 0; k < chunks; k++) {
+        // the slots of the chunks up to k - 1 are free again
+        for (int f = 0; f < 2; f++) {
+            while (p.queued[f] < MIN(chunks, k + p.depth[f])) { pipeline_queue(ring, &p, f); }
+        }
+        int ret = uring_wait(ring, 0, pipeline_complete, &p); // just submits
+        while (ret == 0 && (!p.done[0][k % p.depth[0]] || !p.done[1][k % p.depth[1]])) {
+            ret = uring_wait(ring, 1, pipeline_complete, &p);
+        }
+        if (ret < 0 && p.pending > 0) { // the ring failed, after finishing what it had: read the rest here
+            free(buffers);
+            return compare_sequential(lower_file, upper_file, chunk_offset(&p, k), end, feed, output);
+        }
+        return_val = pipeline_finish(&p, k);
+        if (return_val != COMPARED) { break; }
+        if (!blocks_equal(chunk_buffer(&p, 0, k), chunk_buffer(&p, 1, k), chunk_size(&p, k))) {
+            *output = false;
+            break;
+        }
+        feed_upper(feed, chunk_buffer(&p, 1, k), chunk_offset(&p, k), chunk_size(&p, k));
+    }
+    pipeline_drain(ring, &p);
+    free(buffers);
+    return return_val;
+}
+
+// compares [offset, end) of both files, a chunk of one, then of the other, then comparing them
+static int compare_sequential(int lower_file, int upper_file, off_t offset, off_t end, struct compare_feed *feed, bool *output) {
+    bool uncached = uncached_enabled();
+    size_t len = ROUND_UP((size_t) MIN(end - offset, (off_t) READ_BUFFER_SIZE), UNCACHED_ALIGN);
+    char *lower_buffer;
+    if (posix_memalign((void **) &lower_buffer, UNCACHED_ALIGN, 2 * len) != 0) { return LOWER_READ_ERROR; }
+    char *upper_buffer = lower_buffer + len;
+    if (!uncached) {
+        posix_fadvise(lower_file, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(upper_file, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+    }
+    int return_val = COMPARED;
+    *output = true;
+    while (offset < end) {
+        size_t want = (size_t) MIN(end - offset, (off_t) len);
+        size_t read_len = uncached ? ROUND_UP(want, UNCACHED_ALIGN) : want; // past end, or EOF, is read but not compared
+        ssize_t read_lower = read_full(lower_file, lower_buffer, read_len, offset);
+        ssize_t read_upper = read_full(upper_file, upper_buffer, read_len, offset);
+        if (read_lower < 0) { return_val = LOWER_READ_ERROR; break; }
+        if (read_upper < 0) { return_val = UPPER_READ_ERROR; break; }
+        if ((size_t) read_lower < want || (size_t) read_upper < want) { return_val = SIZE_MISMATCH; break; } // shrunk since the sizes were checked
+        if (!blocks_equal(lower_buffer, upper_buffer, want)) {
+            *output = false;
+            break;
+        }
+        feed_upper(feed, upper_buffer, offset, want);
+        offset += (off_t) want;
+    }
+    free(lower_buffer);
+    return return_val;
+}
+
+// compares [offset, end) of both files. the buffers are aligned, so they can take O_DIRECT reads
+static int compare_read(int lower_file, int upper_file, off_t offset, off_t end, const struct readers *readers, struct compare_feed *feed, bool *output) {
+    if (uncached_enabled()) { offset &= ~((off_t) UNCACHED_ALIGN - 1); } // like mappings, comparing a few bytes more does no harm
+    if (end - offset > (off_t) READ_BUFFER_SIZE && uncached_bypass(lower_file) && uncached_bypass(upper_file)) {
+        struct uring *ring = pipeline_ring();
+        if (ring != NULL) { return compare_pipelined(ring, lower_file, upper_file, offset, end, readers, feed, output); }
+    }
+    return compare_sequential(lower_file, upper_file, offset, end, feed, output);
+}
+
+// compares [offset, end) of both files, mapped if that is large enough and works (and may fill the page cache)
+static int compare_range(int lower_file, int upper_file, off_t offset, off_t end, const struct readers *readers, struct compare_feed *feed, bool *output) {
+    *output = false;
+    bool map = !uncached_enabled() && end - offset >= MAP_MIN_SIZE;
+    if (map && readers->apart) { // from the page cache, mapping is still faster
+        size_t len = (size_t) MIN(end - offset, MAP_WINDOW);
+        map = uncached_resident(lower_file, offset, len) && uncached_resident(upper_file, offset, len);
+    }
+    if (map) {
+        int mapped = compare_mapped(lower_file, upper_file, &offset, end);
+        if (mapped > 0) { return COMPARED; }
+        if (mapped == 0) {
+            *output = true;
+            return COMPARED;
+        }
+    }
+    return compare_read(lower_file, upper_file, offset, end, readers, feed, output);
+}
+
+/*
+ * one file pair being compared in ranges. the thread comparing it hands out ranges to the pool threads and takes
+ * them itself, in order. each range is read with pread(), so every thread keeps its own request in flight. all fields
+ * are protected by the pool lock
+ */
+struct split_job {
+    int lower_file;
+    int upper_file;
+    const struct readers *readers;
+    off_t next; // the next range to hand out
+    off_t end;
+    int running; // pool threads comparing a range of it
+    bool cancelled; // a range was found not identical: no more are handed out
+    off_t failed; // the offset of the first range not identical, end if none
+    int return_val; // and what it was, COMPARED meaning a mismatch
+    struct split_job *next_job;
+};
+
+struct compare_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a job is queued, or the pool stops
+    pthread_cond_t done; // signalled when a pool thread finished a range
+    struct split_job *jobs; // the jobs with ranges left
+    off_t split_size;
+    bool stop;
+    int nthreads;
+    pthread_t threads[];
+};
+
+// takes the next range of job, returns false if there is none left. call with pool->lock held
+static bool split_take(struct split_job *job, off_t *offset, off_t *end) {
+    if (job->cancelled || job->next >= job->end) { return false; }
+    *offset = job->next;
+    *end = MIN(job->next + SPLIT_CHUNK, job->end);
+    job->next = *end;
+    return true;
+}
+
+// call with pool->lock held
+static void split_done(struct split_job *job, off_t offset, int return_val, bool identical) {
+    if (return_val == COMPARED && identical) { return; }
+    job->cancelled = true;
+    if (offset < job->failed) { // the result is the one the serial comparison would have found, mostly
+        job->failed = offset;
+        job->return_val = return_val;
+    }
+}
+
+static void split_unlink(struct compare_pool *pool, struct split_job *job) {
+    for (struct split_job **j = &pool->jobs; *j != NULL; j = &(*j)->next_job) {
+        if (*j == job) {
+            *j = job->next_job;
+            return;
+        }
+    }
+}
+
+static void *split_thread(void *arg) {
+    struct compare_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct split_job *job = pool->jobs;
+        off_t offset, end;
+        while (job != NULL && !split_take(job, &offset, &end)) { // drained: the thread that queued it unlinks it
+            job = job->next_job;
+        }
+        if (job == NULL) {
+            if (pool->stop) { break; }
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        job->running++;
+        pthread_mutex_unlock(&pool->lock);
+        bool identical;
+        int return_val = compare_read(job->lower_file, job->upper_file, offset, end, job->readers, NULL, &identical);
+        pthread_mutex_lock(&pool->lock);
+        split_done(job, offset, return_val, identical);
+        job->running--;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct compare_pool *compare_pool_new(int nthreads, off_t split_size) {
+    struct compare_pool *pool = calloc(1, sizeof(struct compare_pool) + (size_t) nthreads * sizeof(pthread_t));
+    if (pool == NULL) { return NULL; }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->split_size = MAX(split_size, SPLIT_CHUNK);
+    for (; pool->nthreads < nthreads; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, split_thread, pool) != 0) { break; }
+    }
+    if (pool->nthreads == 0) {
+        compare_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void compare_pool_free(struct compare_pool *pool) {
+    if (pool == NULL) { return; }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) { pthread_join(pool->threads[i], NULL); }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+// compares [offset, end) of both files in ranges, on the pool threads and this one
+static int compare_split(struct compare_pool *pool, int lower_file, int upper_file, off_t offset, off_t end, const struct readers *readers, bool *output) {
+    struct split_job job = {
+        .lower_file = lower_file,
+        .upper_file = upper_file,
+        .readers = readers,
+        .next = offset,
+        .end = end,
+        .failed = end,
+        .return_val = COMPARED,
+    };
+    pthread_mutex_lock(&pool->lock);
+    job.next_job = pool->jobs;
+    pool->jobs = &job;
+    pthread_cond_broadcast(&pool->work);
+    off_t range_offset, range_end;
+    while (split_take(&job, &range_offset, &range_end)) {
+        pthread_mutex_unlock(&pool->lock);
+        bool identical;
+        int return_val = compare_read(lower_file, upper_file, range_offset, range_end, readers, NULL, &identical);
+        pthread_mutex_lock(&pool->lock);
+        split_done(&job, range_offset, return_val, identical);
+    }
+    split_unlink(pool, &job);
+    while (job.running > 0) { pthread_cond_wait(&pool->done, &pool->lock); }
+    pthread_mutex_unlock(&pool->lock);
+    *output = (job.failed == end);
+    return job.return_val;
+}
+
+// both files still end at size: nothing was appended since it was checked, nor cut off (which holes would not tell)
+static int compare_tail(int lower_file, int upper_file, off_t size) {
+    char c[2];
+    off_t offset = (size > 0) ? size - 1 : 0;
+    ssize_t expected = (size > 0) ? 1 : 0;
+    ssize_t read_lower = read_full(lower_file, c, 2, offset);
+    ssize_t read_upper = read_full(upper_file, c, 2, offset);
+    if (read_lower < 0) { return LOWER_READ_ERROR; }
+    if (read_upper < 0) { return UPPER_READ_ERROR; }
+    return (read_lower == expected && read_upper == expected) ? COMPARED : SIZE_MISMATCH;
+}
+
+// where fd has data (SEEK_DATA) or a hole (SEEK_HOLE) next from offset on, at most size
+static off_t seek_segment(int fd, off_t offset, int whence, off_t size) {
+    off_t ret = lseek(fd, offset, whence);
+    if (ret >= 0) { return MIN(ret, size); }
+    if (whence == SEEK_DATA && errno != ENXIO) { return offset; } // cannot tell: take it all as data
+    return size; // no data past offset, or the hole at EOF
+}
+
+/*
+ * the next segment from *offset on where either file has data and the other does not change between data and hole.
+ * moves *offset to its start, sets *end. *offset reaches size if both files have nothing but holes left
+ */
+static void data_segment(int lower_file, int upper_file, off_t size, off_t *offset, off_t *end) {
+    off_t lower_data = seek_segment(lower_file, *offset, SEEK_DATA, size);
+    off_t upper_data = seek_segment(upper_file, *offset, SEEK_DATA, size);
+    *offset = MIN(lower_data, upper_data);
+    *end = size;
+    if (*offset >= size) { return; }
+    off_t lower_end = (lower_data == *offset) ? seek_segment(lower_file, *offset, SEEK_HOLE, size) : lower_data;
+    off_t upper_end = (upper_data == *offset) ? seek_segment(upper_file, *offset, SEEK_HOLE, size) : upper_data;
+    *end = MIN(lower_end, upper_end);
+    if (*end <= *offset) { *end = size; } // changed meanwhile
+}
+
+struct extent_batch {
+    struct fiemap map;
+    struct fiemap_extent extents[EXTENT_BATCH];
+};
+
+/*
+ * the extents of fd from start on, after writing back its dirty pages if sync. without, an overwrite of a shared block
+ * not written back yet may still show as the old shared extent (XFS keeps it in the CoW fork, FIEMAP shows the data fork)
+ */
+static int extents_get(int fd, uint64_t start, bool sync, struct extent_batch *batch) {
+    memset(batch, 0, sizeof(struct extent_batch));
+    batch->map.fm_start = start;
+    batch->map.fm_length = FIEMAP_MAX_OFFSET - start;
+    batch->map.fm_flags = sync ? FIEMAP_FLAG_SYNC : 0;
+    batch->map.fm_extent_count = EXTENT_BATCH;
+    return ioctl(fd, FS_IOC_FIEMAP, &batch->map);
+}
+
+/*
+ * whether the two files are made of the very same physical extents (and holes), as reflinked copies are: then their
+ * contents are identical without reading them. false whenever that cannot be told for sure, e.g. for files on
+ * different devices, as physical addresses are per filesystem. only a synced mapping can tell it for sure, see
+ * extents_get(): an unsynced one is only good for telling the files apart cheaply
+ */
+static bool extents_shared(int lower_file, int upper_file, const struct stat *lower_status, const struct stat *upper_status, bool sync) {
+    if (lower_status->st_dev != upper_status->st_dev) { return false; }
+    struct extent_batch lower, upper;
+    uint64_t start = 0;
+    for (;;) {
+        if (extents_get(lower_file, start, sync, &lower) != 0) { return false; }
+        uint32_t n = lower.map.fm_mapped_extents;
+        // on filesystems without reflinks there is a single ioctl per file pair
+        if (n > 0 && (!(lower.extents[0].fe_flags & FIEMAP_EXTENT_SHARED) || (lower.extents[0].fe_flags & EXTENT_OPAQUE))) { return false; }
+        if (extents_get(upper_file, start, sync, &upper) != 0) { return false; }
+        if (upper.map.fm_mapped_extents != n) { return false; }
+        if (n == 0) { return true; } // nothing but holes from start on
+        for (uint32_t i = 0; i < n; i++) {
+            const struct fiemap_extent *l = &lower.extents[i];
+            const struct fiemap_extent *u = &upper.extents[i];
+            if (!(l->fe_flags & FIEMAP_EXTENT_SHARED) || (l->fe_flags & EXTENT_OPAQUE)) { return false; }
+            if (l->fe_logical != u->fe_logical || l->fe_physical != u->fe_physical || l->fe_length != u->fe_length || l->fe_flags != u->fe_flags) { return false; }
+        }
+        const struct fiemap_extent *last = &lower.extents[n - 1];
+        if (last->fe_flags & FIEMAP_EXTENT_LAST) { return true; }
+        start = last->fe_logical + last->fe_length;
+    }
+}
+
+// fewer blocks than the size needs
+static bool is_sparse(const struct stat *status) {
+    return status->st_blocks < status->st_size / 512;
+}
+
+void compare_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_NONBLOCK)) { fcntl(fd, F_SETFL, flags & ~O_NONBLOCK); }
+}
+
+/*
+ * compares the last block, and one picked at random in each of SAMPLE_COUNT stretches of the rest. *output is false if
+ * one of them differs; otherwise the whole files are still to be compared
+ */
+static int compare_samples(int lower_file, int upper_file, off_t size, bool *output) {
+    char *buffer;
+    if (posix_memalign((void **) &buffer, UNCACHED_ALIGN, 2 * SAMPLE_BLOCK) != 0) { return LOWER_READ_ERROR; }
+    off_t blocks = (size + (off_t) SAMPLE_BLOCK - 1) / (off_t) SAMPLE_BLOCK;
+    uint64_t state = (uint64_t) size * 0x9e3779b97f4a7c15u | 1; // xorshift, the same blocks every run
+    int return_val = COMPARED;
+    *output = true;
+    for (int i = 0; i <= SAMPLE_COUNT && return_val == COMPARED && *output; i++) {
+        off_t block = blocks - 1;
+        if (i > 0) { // block 0 is where the comparison starts anyway
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            off_t first = 1 + (blocks - 2) * (i - 1) / SAMPLE_COUNT;
+            off_t last = 1 + (blocks - 2) * i / SAMPLE_COUNT;
+            block = first + (off_t) (state % (uint64_t) (last - first));
+        }
+        off_t offset = block * (off_t) SAMPLE_BLOCK;
+        size_t want = (size_t) MIN(size - offset, (off_t) SAMPLE_BLOCK);
+        ssize_t read_lower = read_full(lower_file, buffer, SAMPLE_BLOCK, offset);
+        ssize_t read_upper = read_full(upper_file, buffer + SAMPLE_BLOCK, SAMPLE_BLOCK, offset);
+        if (read_lower < 0) {
+            return_val = LOWER_READ_ERROR;
+        } else if (read_upper < 0) {
+            return_val = UPPER_READ_ERROR;
+        } else if ((size_t) read_lower < want || (size_t) read_upper < want) {
+            return_val = SIZE_MISMATCH;
+        } else {
+            *output = blocks_equal(buffer, buffer + SAMPLE_BLOCK, want);
+        }
+    }
+    free(buffer);
+    return return_val;
+}
+
+// compares the whole of both files, or just the segments where either has data
+static int compare_segments(int lower_file, int upper_file, off_t size, bool sparse, const struct readers *readers, struct compare_pool *pool, struct compare_feed *feed, bool *output) {
+    off_t offset = 0;
+    while (offset < size) {
+        off_t end = size;
+        if (sparse) {
+            data_segment(lower_file, upper_file, size, &offset, &end);
+            if (offset >= size) { break; }
+        }
+        int return_val = (pool != NULL && end - offset >= pool->split_size)
+            ? compare_split(pool, lower_file, upper_file, offset, end, readers, output)
+            : compare_range(lower_file, upper_file, offset, end, readers, feed, output);
+        if (return_val != COMPARED || !*output) { return return_val; }
+        offset = end;
+    }
+    *output = true;
+    return COMPARED;
+}
+
+int compare_files(int lower_file, int upper_file, off_t size, struct compare_pool *pool, bool *output, bool *read_all, struct compare_feed *feed) {
+    *output = false;
+    if (feed != NULL) { feed->next = 0; }
+    if (read_all != NULL) { *read_all = false; }
+    bool sparse = false;
+    struct readers readers = default_readers;
+    if (size >= EXTENT_MIN_SIZE) {
+        struct stat lower_status, upper_status;
+        if (fstat(lower_file, &lower_status) == 0 && fstat(upper_file, &upper_status) == 0) {
+            // the writeback is only paid for the pairs that look shared already
+            if (extents_shared(lower_file, upper_file, &lower_status, &upper_status, false)
+                && extents_shared(lower_file, upper_file, &lower_status, &upper_status, true)) {
+                *output = true;
+                return COMPARED;
+            }
+            // only the data segments are compared, holes read as zeros anyway
+            sparse = is_sparse(&lower_status) || is_sparse(&upper_status);
+            readers.depth[0] = device_depth(lower_status.st_dev);
+            readers.depth[1] = device_depth(upper_status.st_dev);
+            readers.apart = device_apart(lower_status.st_dev, upper_status.st_dev);
+        }
+    }
+    if (read_all != NULL) { *read_all = !sparse; }
+    if (size > (off_t) READ_BUFFER_SIZE) {
+        compare_blocking(lower_file);
+        compare_blocking(upper_file);
+    }
+    uncached_direct(lower_file, true);
+    uncached_direct(upper_file, true);
+    *output = true;
+    int return_val = (size >= SAMPLE_MIN_SIZE) ? compare_samples(lower_file, upper_file, size, output) : COMPARED;
+    if (return_val == COMPARED && *output) { return_val = compare_segments(lower_file, upper_file, size, sparse, &readers, pool, feed, output); }
+    uncached_direct(lower_file, false); // the tail is read unaligned
+    uncached_direct(upper_file, false);
+    if (return_val != COMPARED || !*output) { return return_val; }
+    return compare_tail(lower_file, upper_file, size);
+}
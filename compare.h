@@ -0,0 +1,54 @@
+/*
+ * compare.h / compare.c
+ *
+ * the content comparison of two regular files. reflinked copies are recognised by their extent maps alone, others are
+ * mapped a window at a time and compared with a vectorized equality loop, or read where they cannot be mapped: the next
+ * chunk of both files through io_uring while the current one is compared. of sparse files only the segments where
+ * either has data are looked at
+ */
+
+#ifndef OVERLAYFS_TOOLS_COMPARE_H
+#define OVERLAYFS_TOOLS_COMPARE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+enum { COMPARED, LOWER_READ_ERROR, UPPER_READ_ERROR, SIZE_MISMATCH };
+
+// threads comparing the ranges of large files concurrently, shared by all the threads of a traversal
+struct compare_pool;
+
+/*
+ * start nthreads threads comparing ranges of files (or of data segments of sparse files) of at least split_size
+ * bytes. returns NULL if no thread could be started
+ */
+struct compare_pool *compare_pool_new(int nthreads, off_t split_size);
+
+void compare_pool_free(struct compare_pool *pool);
+
+/*
+ * gets the contents of the upper file as they are compared, where they are read in order: read into buffers, not in
+ * mapped windows or ranges split over the pool. next is where fn() is to go on from, -1 once it missed a part
+ */
+struct compare_feed {
+    void (*fn)(void *arg, const char *data, size_t len);
+    void *arg;
+    off_t next;
+};
+
+/*
+ * compares the contents of two files whose sizes were both found to be size, split over pool unless that is NULL.
+ * prints nothing, returns one of the values above, *output is only meaningful with COMPARED. the file offsets are
+ * not used. unless read_all is NULL, *read_all tells whether both files were read in full, rather than just the data
+ * of sparse files or their extent maps. unless feed is NULL, feed->next is size afterwards if fn() got all of the
+ * upper file
+ */
+int compare_files(int lower_file, int upper_file, off_t size, struct compare_pool *pool, bool *output, bool *read_all, struct compare_feed *feed);
+
+/*
+ * clears O_NONBLOCK on fd. upper files are opened with it, in case a FIFO was swapped in, but io_uring fails reads of
+ * a regular file with EAGAIN then
+ */
+void compare_blocking(int fd);
+
+#endif //OVERLAYFS_TOOLS_COMPARE_H
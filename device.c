@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include <sys/sysmacros.h>
+#include "device.h"
+
+// devices remembered, there are hardly more than two in a run
+#define DEVICE_CACHE 16
+#define DEPTH_ROTATIONAL 2
+#define DEPTH_SOLID_STATE 4
+
+struct device {
+    dev_t dev;
+    dev_t disk; // the whole disk of a partition, 0 if not a block device
+    int depth;
+};
+
+static struct device devices[DEVICE_CACHE];
+static int ndevices;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the first line of a sysfs attribute, without the newline
+static bool sysfs_read(const char *dir, const char *name, char *buf, size_t size) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path)) { return false; }
+    FILE *f = fopen(path, "re");
+    if (f == NULL) { return false; }
+    bool ok = (fgets(buf, (int) size, f) != NULL);
+    fclose(f);
+    if (ok) { buf[strcspn(buf, "\n")] = '\0'; }
+    return ok;
+}
+
+static void device_probe(dev_t dev, struct device *d) {
+    d->dev = dev;
+    d->disk = 0;
+    d->depth = DEPTH_ROTATIONAL;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    char *dir = realpath(path, NULL); // .../block/sda/sda1 for a partition, .../block/sda for its disk
+    if (dir == NULL) { return; }
+    char buf[64];
+    if (sysfs_read(dir, "partition", buf, sizeof(buf))) { *strrchr(dir, '/') = '\0'; }
+    unsigned disk_major, disk_minor;
+    if (sysfs_read(dir, "dev", buf, sizeof(buf)) && sscanf(buf, "%u:%u", &disk_major, &disk_minor) == 2) {
+        d->disk = makedev(disk_major, disk_minor);
+    }
+    if (sysfs_read(dir, "queue/rotational", buf, sizeof(buf)) && strcmp(buf, "0") == 0) { d->depth = DEPTH_SOLID_STATE; }
+    free(dir);
+}
+
+static struct device device_get(dev_t dev) {
+    pthread_mutex_lock(&devices_lock);
+    for (int i = 0; i < ndevices; i++) {
+        if (devices[i].dev == dev) {
+            struct device d = devices[i];
+            pthread_mutex_unlock(&devices_lock);
+            return d;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+    struct device d;
+    device_probe(dev, &d); // sysfs is not read with the lock held, another thread may probe the same device meanwhile
+    pthread_mutex_lock(&devices_lock);
+    if (ndevices < DEVICE_CACHE) { devices[ndevices++] = d; }
+    pthread_mutex_unlock(&devices_lock);
+    return d;
+}
+
+int device_depth(dev_t dev) {
+    return device_get(dev).depth;
+}
+
+bool device_apart(dev_t a, dev_t b) {
+    if (a == b) { return false; }
+    dev_t disk_a = device_get(a).disk;
+    dev_t disk_b = device_get(b).disk;
+    return disk_a != 0 && disk_b != 0 && disk_a != disk_b;
+}
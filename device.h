@@ -0,0 +1,26 @@
+/*
+ * device.h / device.c
+ *
+ * what the comparison knows of the storage under the files: which disk a filesystem is on, as /sys/dev/block tells,
+ * and how many reads to keep in flight on it
+ */
+
+#ifndef OVERLAYFS_TOOLS_DEVICE_H
+#define OVERLAYFS_TOOLS_DEVICE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * how many chunks of a file on dev to keep read ahead of the comparison: more on SSDs, which serve several requests
+ * at once, than on spinning disks or where it cannot be told
+ */
+int device_depth(dev_t dev);
+
+/*
+ * whether the filesystems a and b are on different disks, which can be read at the same time. false if that cannot be
+ * told, e.g. for network filesystems or btrfs subvolumes, whose st_dev is not a block device
+ */
+bool device_apart(dev_t a, dev_t b);
+
+#endif //OVERLAYFS_TOOLS_DEVICE_H
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/xattr.h>
+#include "digest.h"
+#include "uncached.h"
+#include "throttle.h"
+
+// not under trusted.overlay., which overlayfs would take for its own
+#define DIGEST_XATTR "trusted.overlaytools.digest"
+#define DIGEST_BUFFER_SIZE ((size_t) 1 << 20)
+// how long after the write started the ctime of a file setting the xattr may be (see digest.h). a write taking longer
+// is caught by checking ctime afterwards
+#define CTIME_SLACK_NSEC 20000000L
+
+// SHA-256 (FIPS 180-4)
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length; // in bytes
+    unsigned char block[64];
+    size_t used; // bytes in block
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(struct sha256 *h) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->length = 0;
+    h->used = 0;
+}
+
+static void sha256_block(uint32_t *state, const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_update(struct sha256 *h, const unsigned char *data, size_t len) {
+    h->length += len;
+    if (h->used > 0) {
+        size_t n = (len < 64 - h->used) ? len : 64 - h->used;
+        memcpy(h->block + h->used, data, n);
+        h->used += n;
+        data += n;
+        len -= n;
+        if (h->used < 64) { return; }
+        sha256_block(h->state, h->block);
+        h->used = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) { sha256_block(h->state, data); }
+    memcpy(h->block, data, len);
+    h->used = len;
+}
+
+static void sha256_final(struct sha256 *h, unsigned char *digest) {
+    uint64_t bits = h->length * 8;
+    h->block[h->used++] = 0x80;
+    if (h->used > 56) {
+        memset(h->block + h->used, 0, 64 - h->used);
+        sha256_block(h->state, h->block);
+        h->used = 0;
+    }
+    memset(h->block + h->used, 0, 56 - h->used);
+    for (int i = 0; i < 8; i++) { h->block[56 + i] = (unsigned char) (bits >> (56 - 8 * i)); }
+    sha256_block(h->state, h->block);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char) (h->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char) (h->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char) (h->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char) h->state[i];
+    }
+}
+
+// the cache xattr: the digest, then the stat keys it is valid for, as text so getfattr shows what is going on. when the
+// file was found identical to a lower file, the keys of that one follow
+
+#define VALUE_SIZE 512
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) { return (a->tv_sec < b->tv_sec) ? -1 : 1; }
+    return (a->tv_nsec < b->tv_nsec) ? -1 : (a->tv_nsec > b->tv_nsec);
+}
+
+static bool same_keys(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size && timespec_cmp(&a->st_mtim, &b->st_mtim) == 0 && timespec_cmp(&a->st_ctim, &b->st_ctim) == 0;
+}
+
+// the value cached on fd if status shows the file unchanged since, with *lower_keys pointing into it ("" if none)
+static bool value_get(int fd, const struct stat *status, char *value, unsigned char *digest, const char **lower_keys) {
+    ssize_t len = fgetxattr(fd, DIGEST_XATTR, value, VALUE_SIZE - 1);
+    if (len <= 0) { return false; }
+    value[len] = '\0';
+    char hex[2 * DIGEST_SIZE + 1];
+    uintmax_t ino;
+    intmax_t size, mtime_sec, ctime_sec, limit_sec;
+    long mtime_nsec, ctime_nsec, limit_nsec;
+    int end = 0;
+    if (sscanf(value, "sha256=%64[0-9a-f] ino=%ju size=%jd mtime=%jd.%ld ctime=%jd.%ld-%jd.%ld%n",
+               hex, &ino, &size, &mtime_sec, &mtime_nsec, &ctime_sec, &ctime_nsec, &limit_sec, &limit_nsec, &end) != 9) { return false; }
+    if (strlen(hex) != 2 * DIGEST_SIZE) { return false; }
+    struct timespec mtime = { .tv_sec = (time_t) mtime_sec, .tv_nsec = mtime_nsec };
+    struct timespec ctime = { .tv_sec = (time_t) ctime_sec, .tv_nsec = ctime_nsec };
+    struct timespec limit = { .tv_sec = (time_t) limit_sec, .tv_nsec = limit_nsec };
+    if (ino != (uintmax_t) status->st_ino || size != (intmax_t) status->st_size || timespec_cmp(&mtime, &status->st_mtim) != 0) { return false; }
+    if (timespec_cmp(&status->st_ctim, &ctime) < 0 || timespec_cmp(&status->st_ctim, &limit) > 0) { return false; }
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) { return false; }
+        digest[i] = (unsigned char) byte;
+    }
+    *lower_keys = value + end;
+    return true;
+}
+
+// the keys of a lower file, as they follow those of the file the value is set on
+static int lower_keys_format(char *buf, size_t size, const struct stat *lower_status) {
+    return snprintf(buf, size, " lower_ino=%ju lower_size=%jd lower_mtime=%jd.%09ld lower_ctime=%jd.%09ld",
+                    (uintmax_t) lower_status->st_ino, (intmax_t) lower_status->st_size, (intmax_t) lower_status->st_mtim.tv_sec,
+                    lower_status->st_mtim.tv_nsec, (intmax_t) lower_status->st_ctim.tv_sec, lower_status->st_ctim.tv_nsec);
+}
+
+bool digest_get(int fd, const struct stat *status, unsigned char *digest) {
+    char value[VALUE_SIZE];
+    const char *lower_keys;
+    return value_get(fd, status, value, digest, &lower_keys);
+}
+
+bool digest_identical(int upper_fd, const struct stat *upper_status, const struct stat *lower_status) {
+    char value[VALUE_SIZE], expected[VALUE_SIZE];
+    unsigned char digest[DIGEST_SIZE];
+    const char *lower_keys;
+    if (!value_get(upper_fd, upper_status, value, digest, &lower_keys)) { return false; }
+    // the lower file is never written, so its ctime is known exactly
+    int len = lower_keys_format(expected, sizeof(expected), lower_status);
+    return len > 0 && (size_t) len < sizeof(expected) && strcmp(lower_keys, expected) == 0;
+}
+
+int digest_file(int fd, unsigned char *digest) {
+    unsigned char *buffer;
+    if (posix_memalign((void **) &buffer, UNCACHED_ALIGN, DIGEST_BUFFER_SIZE) != 0) { return -1; }
+    uncached_direct(fd, true);
+    struct sha256 h;
+    sha256_init(&h);
+    off_t offset = 0;
+    int return_val = 0;
+    for (;;) {
+        throttle(DIGEST_BUFFER_SIZE);
+        ssize_t ret = uncached_pread(fd, buffer, DIGEST_BUFFER_SIZE, offset);
+        if (ret == 0) { break; }
+        if (ret < 0) {
+            if (errno == EINTR) { continue; }
+            return_val = -1;
+            break;
+        }
+        sha256_update(&h, buffer, (size_t) ret);
+        offset += ret;
+    }
+    uncached_direct(fd, false);
+    free(buffer);
+    if (return_val == 0) { sha256_final(&h, digest); }
+    return return_val;
+}
+
+// digest_set(), followed by the keys of lower_status unless that is NULL
+static bool value_set(int fd, const struct stat *before, const unsigned char *digest, const struct stat *lower_status) {
+    struct stat now;
+    if (fstat(fd, &now) != 0 || !same_keys(before, &now)) { return false; }
+    struct timespec limit;
+    if (clock_gettime(CLOCK_REALTIME, &limit) != 0) { return true; }
+    limit.tv_nsec += CTIME_SLACK_NSEC;
+    if (limit.tv_nsec >= 1000000000L) {
+        limit.tv_sec++;
+        limit.tv_nsec -= 1000000000L;
+    }
+    char hex[2 * DIGEST_SIZE + 1];
+    for (int i = 0; i < DIGEST_SIZE; i++) { sprintf(hex + 2 * i, "%02x", digest[i]); }
+    char value[VALUE_SIZE];
+    int len = snprintf(value, sizeof(value), "sha256=%s ino=%ju size=%jd mtime=%jd.%09ld ctime=%jd.%09ld-%jd.%09ld",
+                       hex, (uintmax_t) now.st_ino, (intmax_t) now.st_size, (intmax_t) now.st_mtim.tv_sec, now.st_mtim.tv_nsec,
+                       (intmax_t) now.st_ctim.tv_sec, now.st_ctim.tv_nsec, (intmax_t) limit.tv_sec, limit.tv_nsec);
+    if (len < 0 || (size_t) len >= sizeof(value)) { return true; }
+    if (lower_status != NULL) {
+        int more = lower_keys_format(value + len, sizeof(value) - (size_t) len, lower_status);
+        if (more < 0 || (size_t) more >= sizeof(value) - (size_t) len) { return true; }
+        len += more;
+    }
+    if (fsetxattr(fd, DIGEST_XATTR, value, (size_t) len, 0) != 0) { return true; }
+    // a clock stepped back, or a write that took very long, would leave a value that never matches
+    if (fstat(fd, &now) == 0 && timespec_cmp(&now.st_ctim, &limit) > 0) { fremovexattr(fd, DIGEST_XATTR); }
+    return true;
+}
+
+bool digest_set(int fd, const struct stat *before, const unsigned char *digest) {
+    return value_set(fd, before, digest, NULL);
+}
+
+struct digest_stream {
+    struct sha256 h;
+};
+
+struct digest_stream *digest_stream_new(void) {
+    struct digest_stream *stream = malloc(sizeof(struct digest_stream));
+    if (stream != NULL) { sha256_init(&stream->h); }
+    return stream;
+}
+
+void digest_stream_update(void *stream, const char *data, size_t len) {
+    sha256_update(&((struct digest_stream *) stream)->h, (const unsigned char *) data, len);
+}
+
+void digest_stream_free(struct digest_stream *stream) {
+    free(stream);
+}
+
+void digest_set_identical(int upper_file, const struct stat *upper_status, int lower_file, const struct stat *lower_status, struct digest_stream *stream) {
+    unsigned char digest[DIGEST_SIZE];
+    if (stream != NULL) {
+        sha256_final(&stream->h, digest);
+    } else if (digest_file(upper_file, digest) != 0) {
+        return;
+    }
+    // the lower file must not have changed while the pair was compared either
+    struct stat now;
+    if (fstat(lower_file, &now) != 0 || !same_keys(lower_status, &now)) { return; }
+    value_set(upper_file, upper_status, digest, lower_status);
+}
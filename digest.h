@@ -0,0 +1,62 @@
+/*
+ * digest.h / digest.c
+ *
+ * the content digest (SHA-256) of a file, cached in a trusted.overlaytools.digest xattr on the file itself together
+ * with the stat keys it was computed for, so later runs can skip reading it. only upper files get one: an upper file
+ * found identical to its lower file also keeps the stat keys of that one, so lowerdir is never written to.
+ *
+ * setting the xattr changes the ctime of the file, to a value that cannot be known before. the xattr keeps the range
+ * from when it is set to 20 ms later instead, and the digest is taken as valid for any ctime in it: a change in those
+ * 20 ms that also restores mtime (and size) goes unnoticed
+ */
+
+#ifndef OVERLAYFS_TOOLS_DIGEST_H
+#define OVERLAYFS_TOOLS_DIGEST_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define DIGEST_SIZE 32
+
+/*
+ * the cached digest of fd, if there is one and status (fresh from fstat) shows the file unchanged since
+ */
+bool digest_get(int fd, const struct stat *status, unsigned char *digest);
+
+/*
+ * computes the digest of the whole file. returns 0 on success, -1 if it cannot be read
+ */
+int digest_file(int fd, unsigned char *digest);
+
+/*
+ * caches digest on fd, unless the file has changed since before was taken from fstat(). returns whether it was
+ * unchanged (whether the xattr could be set or not)
+ */
+bool digest_set(int fd, const struct stat *before, const unsigned char *digest);
+
+/*
+ * whether the digest cached on upper_fd is still valid and was set by digest_set_identical() with a lower file whose
+ * stat keys are those of lower_status: the two files are then identical
+ */
+bool digest_identical(int upper_fd, const struct stat *upper_status, const struct stat *lower_status);
+
+// a digest computed from contents read elsewhere, in order, so they are not read again for it
+struct digest_stream;
+
+// returns NULL if out of memory
+struct digest_stream *digest_stream_new(void);
+
+// adds the next len bytes of the file. takes a void pointer, to be the fn of a struct compare_feed
+void digest_stream_update(void *stream, const char *data, size_t len);
+
+void digest_stream_free(struct digest_stream *stream);
+
+/*
+ * caches the digest of upper_file there with the keys of lower_file, the two having just been found identical: that of
+ * stream if it is not NULL (it must have been given the whole file), otherwise the file is read again for it.
+ * upper_status and lower_status are from before the comparison: nothing is cached if either file changed since.
+ * failures are ignored, the files are just compared again next time
+ */
+void digest_set_identical(int upper_file, const struct stat *upper_status, int lower_file, const struct stat *lower_status, struct digest_stream *stream);
+
+#endif //OVERLAYFS_TOOLS_DIGEST_H
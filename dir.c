@@ -0,0 +1,111 @@
+/*
+ * dir.c - Directory reading for all utilities
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dir.h"
+#include "throttle.h"
+
+/* As returned by getdents64(2), not exported by every libc */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+int dir_open(struct dir_stream *ds, int fd)
+{
+	ds->buf = malloc(DIR_BUF_SIZE);
+	if (!ds->buf) {
+		close(fd);
+		return -1;
+	}
+	ds->fd = fd;
+	ds->pos = ds->end = 0;
+	return 0;
+}
+
+int dir_read(struct dir_stream *ds, struct dir_entry *ent)
+{
+	struct linux_dirent64 *d;
+	long ret;
+
+	for (;;) {
+		if (ds->pos >= ds->end) {
+			throttle(0);
+			do {
+				ret = syscall(SYS_getdents64, ds->fd, ds->buf,
+					      DIR_BUF_SIZE);
+			} while (ret < 0 && errno == EINTR);
+			if (ret <= 0)
+				return ret < 0 ? -1 : 0;
+			ds->pos = 0;
+			ds->end = ret;
+		}
+
+		d = (struct linux_dirent64 *)(ds->buf + ds->pos);
+		ds->pos += d->d_reclen;
+
+		if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+		    (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+			continue;
+
+		ent->name = d->d_name;
+		ent->ino = d->d_ino;
+		ent->type = d->d_type;
+		return 1;
+	}
+}
+
+int dir_rewind(struct dir_stream *ds)
+{
+	if (lseek(ds->fd, 0, SEEK_SET) < 0)
+		return -1;
+	ds->pos = ds->end = 0;
+	return 0;
+}
+
+void dir_close(struct dir_stream *ds)
+{
+	if (ds->fd >= 0)
+		close(ds->fd);
+	free(ds->buf);
+	ds->fd = -1;
+	ds->buf = NULL;
+}
+
+mode_t dir_type_mode(unsigned char type)
+{
+	switch (type) {
+	case DT_DIR:
+		return S_IFDIR;
+	case DT_REG:
+		return S_IFREG;
+	case DT_LNK:
+		return S_IFLNK;
+	case DT_CHR:
+		return S_IFCHR;
+	case DT_BLK:
+		return S_IFBLK;
+	case DT_FIFO:
+		return S_IFIFO;
+	case DT_SOCK:
+		return S_IFSOCK;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * dir.h - Directory reading for all utilities
+ *
+ * A thin reader over getdents64(2) with a large buffer. Unlike fts(3)
+ * and readdir(3) it never stats entries and never copies names: an entry
+ * is only valid until the next dir_read() call.
+ */
+
+#ifndef OVL_DIR_H
+#define OVL_DIR_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Buffer size for one getdents64(2) call, a few thousand entries */
+#define DIR_BUF_SIZE	(128 * 1024)
+
+struct dir_stream {
+	int fd;			/* directory fd, owned by the stream */
+	char *buf;		/* raw linux_dirent64 records */
+	size_t pos;		/* next record in buf */
+	size_t end;		/* end of valid records in buf */
+};
+
+struct dir_entry {
+	const char *name;	/* points into the stream buffer */
+	ino_t ino;
+	unsigned char type;	/* DT_*, DT_UNKNOWN if the fs does not tell */
+};
+
+/* Start reading directory fd, which is closed by dir_close() */
+int dir_open(struct dir_stream *ds, int fd);
+
+/*
+ * Get the next entry, skipping "." and "..".
+ *
+ * Return: 1 if an entry was read, 0 at the end, -1 on error (errno set)
+ */
+int dir_read(struct dir_stream *ds, struct dir_entry *ent);
+
+/* Start over from the first entry. Return: 0 on success, -1 on error */
+int dir_rewind(struct dir_stream *ds);
+
+void dir_close(struct dir_stream *ds);
+
+/* File type bits (S_IFMT) for a DT_* type, 0 if unknown */
+mode_t dir_type_mode(unsigned char type);
+
+#endif /* OVL_DIR_H */
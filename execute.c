@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include "sh.h"
+#include "dir.h"
+#include "throttle.h"
+#include "inode_map.h"
+#include "execute.h"
+
+extern char **environ;
+
+// the most words of a line: cp --attributes-only --preserve=all %U %L
+#define MAX_WORDS 8
+#define COPY_BUFFER_SIZE ((size_t) 1 << 20) // where copy_file_range() cannot be used
+
+// one line of the script, split into words as bash would
+struct line {
+    char *buf; // the words one after the other, each ending with '\0'
+    size_t len;
+    size_t size;
+    int argc;
+    char *argv[MAX_WORDS + 1];
+};
+
+enum { SPLIT_OK, SPLIT_MORE, SPLIT_UNKNOWN };
+
+static bool line_put(struct line *l, const char *s, size_t n) {
+    if (l->len + n > l->size) {
+        size_t size = (l->len + n) * 2 + 256;
+        char *buf = realloc(l->buf, size);
+        if (buf == NULL) { return false; }
+        l->buf = buf;
+        l->size = size;
+    }
+    memcpy(l->buf + l->len, s, n);
+    l->len += n;
+    return true;
+}
+
+// appends the value of the variable "$NAME" at *s to l, moving *s past the name
+static bool line_expand(struct line *l, const char **s, char *values[]) {
+    const char *name = *s + 1;
+    size_t n = 0;
+    while (isupper((unsigned char) name[n]) || name[n] == '_') { n++; }
+    *s = name + n;
+    for (int i = 0; i < NUM_VARS; i++) {
+        if (strlen(var_names[i]) == n && strncmp(var_names[i], name, n) == 0) {
+            return values[i] != NULL && line_put(l, values[i], strlen(values[i]));
+        }
+    }
+    return false;
+}
+
+/*
+ * splits s into l, with "$NAME" replaced by values. only what create_shell_script() and command() write is known:
+ * plain words, '' quoted ones (which may hold newlines, so SPLIT_MORE asks for the next line of the script too) and
+ * "" quoted ones holding nothing but variables and quotes
+ */
+static int split(const char *s, char *values[], struct line *l) {
+    size_t starts[MAX_WORDS];
+    l->len = 0;
+    l->argc = 0;
+    for (;;) {
+        while (*s == ' ' || *s == '\t') { s++; }
+        if (*s == '\0' || *s == '\n' || *s == '#') { break; }
+        if (l->argc == MAX_WORDS) { return SPLIT_UNKNOWN; }
+        starts[l->argc++] = l->len;
+        while (*s != '\0' && *s != '\n' && *s != ' ' && *s != '\t') {
+            if (*s == '\'') {
+                const char *end = strchr(s + 1, '\'');
+                if (end == NULL) { return SPLIT_MORE; }
+                if (!line_put(l, s + 1, (size_t) (end - s - 1))) { return SPLIT_UNKNOWN; }
+                s = end + 1;
+            } else if (*s == '"') {
+                for (s++; *s != '"';) {
+                    if (*s == '$') {
+                        if (!line_expand(l, &s, values)) { return SPLIT_UNKNOWN; }
+                    } else if (*s == '\0' || *s == '\\' || *s == '`') {
+                        return SPLIT_UNKNOWN;
+                    } else if (!line_put(l, s++, 1)) {
+                        return SPLIT_UNKNOWN;
+                    }
+                }
+                s++;
+            } else if (isalnum((unsigned char) *s) || strchr("-_=./+,:", *s) != NULL) {
+                if (!line_put(l, s++, 1)) { return SPLIT_UNKNOWN; }
+            } else {
+                return SPLIT_UNKNOWN;
+            }
+        }
+        if (!line_put(l, "", 1)) { return SPLIT_UNKNOWN; }
+    }
+    for (int i = 0; i < l->argc; i++) { l->argv[i] = l->buf + starts[i]; }
+    l->argv[l->argc] = NULL;
+    return SPLIT_OK;
+}
+
+// a line NAME=value: sets values[NAME]. false if it is not one (or out of memory)
+static bool assign(const struct line *l, char *values[]) {
+    if (l->argc != 1) { return false; }
+    for (int i = 0; i < NUM_VARS; i++) {
+        size_t n = strlen(var_names[i]);
+        if (strncmp(l->argv[0], var_names[i], n) == 0 && l->argv[0][n] == '=') {
+            char *value = strdup(l->argv[0] + n + 1);
+            if (value == NULL) { return false; }
+            free(values[i]);
+            values[i] = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int report(const char *action, const char *path) {
+    fprintf(stderr, "Cannot %s %s: %s\n", action, path, strerror(errno));
+    return -1;
+}
+
+// runs the tool itself, for what is not done here
+static int run_tool(char *const *argv) {
+    pid_t pid;
+    int status;
+    fflush(stdout);
+    int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err != 0) {
+        errno = err;
+        return report("run", argv[0]);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) { return report("wait for", argv[0]); }
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+// removes name in dirfd and everything below it. goes on after a failure, errno is then that of the last one
+static int remove_tree(int dirfd, const char *name) {
+    if (unlinkat(dirfd, name, 0) == 0) { return 0; }
+    if (errno != EISDIR && errno != EPERM) { return -1; } // POSIX allows EPERM for unlinking a directory
+    int unlink_errno = errno;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOTDIR || errno == ELOOP) { errno = unlink_errno; } // not a directory: unlinking it failed
+        return -1;
+    }
+    struct dir_stream ds;
+    if (dir_open(&ds, fd) < 0) { return -1; }
+    struct dir_entry ent;
+    int ret, failed = 0;
+    while ((ret = dir_read(&ds, &ent)) > 0) {
+        if (remove_tree(ds.fd, ent.name) < 0) { failed = errno; }
+    }
+    if (ret < 0) { failed = errno; }
+    dir_close(&ds);
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+// xattrs cp leaves out, as the xattr.conf of libattr has them
+static bool xattr_skipped(const char *name) {
+    static const char *const prefixes[] = { "trusted.SGI_", "security.evm", "security.NTACL", "afs." };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) { return true; }
+    }
+    return false;
+}
+
+// the xattrs of src onto dst. those that cannot be (not supported there, say) are left out without a word, as cp -a does
+static void copy_xattrs(const char *src, const char *dst) {
+    ssize_t size = llistxattr(src, NULL, 0);
+    if (size <= 0) { return; }
+    char *list = malloc((size_t) size);
+    if (list == NULL) { return; }
+    size = llistxattr(src, list, (size_t) size);
+    char *value = NULL;
+    for (const char *name = list; size > 0 && name < list + size; name += strlen(name) + 1) {
+        if (xattr_skipped(name)) { continue; }
+        ssize_t len = lgetxattr(src, name, NULL, 0);
+        if (len < 0) { continue; }
+        char *grown = realloc(value, (size_t) len + 1);
+        if (grown == NULL) { continue; }
+        value = grown;
+        len = lgetxattr(src, name, value, (size_t) len);
+        if (len >= 0) { lsetxattr(dst, name, value, (size_t) len, 0); }
+    }
+    free(value);
+    free(list);
+}
+
+// the owner, mode, xattrs and times of src (whose status is st) onto dst, in the order cp --preserve=all sets them
+static int copy_attributes(const char *src, const char *dst, const struct stat *st) {
+    int failed = 0;
+    if (lchown(dst, st->st_uid, st->st_gid) < 0 && (geteuid() == 0 || (errno != EPERM && errno != EINVAL))) { failed = errno; }
+    if (!S_ISLNK(st->st_mode) && chmod(dst, st->st_mode & 07777) < 0) { failed = errno; } // after chown, which clears setuid
+    copy_xattrs(src, dst);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW) < 0) { failed = errno; }
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return 0;
+}
+
+// [offset, end) of src to dst, in the kernel where it can (which may share the extents instead), read and written if not
+static int copy_range(int src, int dst, off_t offset, off_t end, char **buffer) {
+    while (offset < end) {
+        size_t len = (size_t) ((end - offset < (off_t) COPY_BUFFER_SIZE) ? end - offset : (off_t) COPY_BUFFER_SIZE);
+        throttle(len);
+        if (*buffer == NULL) {
+            off_t in = offset, out = offset;
+            ssize_t ret = copy_file_range(src, &in, dst, &out, len, 0);
+            if (ret > 0) {
+                offset += ret;
+                continue;
+            }
+            if (ret == 0) { return 0; } // shrunk meanwhile
+            if (errno == EINTR) { continue; }
+            if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) { return -1; }
+            if ((*buffer = malloc(COPY_BUFFER_SIZE)) == NULL) { return -1; }
+        }
+        ssize_t ret = pread(src, *buffer, len, offset);
+        if (ret == 0) { return 0; }
+        if (ret < 0) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        for (ssize_t done = 0; done < ret;) {
+            ssize_t written = pwrite(dst, *buffer + done, (size_t) (ret - done), offset + done);
+            if (written < 0) {
+                if (errno == EINTR) { continue; }
+                return -1;
+            }
+            done += written;
+        }
+        offset += ret;
+    }
+    return 0;
+}
+
+// the contents of the regular file src (size bytes) to the new file dst. holes stay holes
+static int copy_contents(const char *src, const char *dst, off_t size) {
+    int src_fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd < 0) { return -1; }
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (dst_fd < 0) {
+        close(src_fd);
+        return -1;
+    }
+    char *buffer = NULL;
+    int return_val = 0;
+    for (off_t offset = 0; offset < size && return_val == 0;) {
+        off_t data = lseek(src_fd, offset, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) { break; } // nothing but a hole up to the end
+            data = offset; // no SEEK_DATA here: the whole file is data
+        }
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) { hole = size; }
+        if (data < hole) { return_val = copy_range(src_fd, dst_fd, data, hole, &buffer); }
+        offset = hole;
+    }
+    if (return_val == 0 && ftruncate(dst_fd, size) < 0) { return_val = -1; } // a hole at the end
+    int saved = errno;
+    free(buffer);
+    close(src_fd);
+    if (close(dst_fd) < 0 && return_val == 0) { return -1; }
+    errno = saved;
+    return return_val;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL) { return NULL; }
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+static int copy_tree(const char *src, const char *dst, struct inode_map *links);
+
+// the entries of the directory src into the directory dst. goes on after a failure, errno is then that of the last one
+static int copy_children(const char *src, const char *dst, struct inode_map *links) {
+    int fd = open(src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) { return -1; }
+    struct dir_stream ds;
+    if (dir_open(&ds, fd) < 0) { return -1; }
+    struct dir_entry ent;
+    int ret, failed = 0;
+    while ((ret = dir_read(&ds, &ent)) > 0) {
+        char *src_child = path_join(src, ent.name);
+        char *dst_child = path_join(dst, ent.name);
+        if (src_child == NULL || dst_child == NULL) {
+            failed = ENOMEM;
+        } else if (copy_tree(src_child, dst_child, links) < 0) {
+            failed = errno;
+        }
+        free(src_child);
+        free(dst_child);
+    }
+    if (ret < 0) { failed = errno; }
+    dir_close(&ds);
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * cp -a src dst, dst not existing: src and everything below it, with their attributes. the names of a file hard linked
+ * within src become links to the first one copied, which links remembers. goes on after a failure, errno is then that
+ * of the last one
+ */
+static int copy_tree(const char *src, const char *dst, struct inode_map *links) {
+    struct stat st;
+    if (lstat(src, &st) < 0) { return -1; }
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        const char *first = inode_map_merged(links, &st, dst);
+        if (first != NULL) { return link(first, dst); }
+    }
+    int failed = 0;
+    switch (st.st_mode & S_IFMT) {
+        case S_IFREG:
+            if (copy_contents(src, dst, st.st_size) < 0) { return -1; }
+            break;
+        case S_IFDIR:
+            if (mkdir(dst, S_IRWXU) < 0) { return -1; }
+            if (copy_children(src, dst, links) < 0) { failed = errno; } // its attributes are still copied
+            break;
+        case S_IFLNK: {
+            char *target = malloc((size_t) st.st_size + 1);
+            if (target == NULL) { return -1; }
+            ssize_t len = readlink(src, target, (size_t) st.st_size + 1);
+            if (len < 0 || len > st.st_size) { // changed meanwhile
+                if (len >= 0) { errno = EAGAIN; }
+                free(target);
+                return -1;
+            }
+            target[len] = '\0';
+            int ret = symlink(target, dst);
+            free(target);
+            if (ret < 0) { return -1; }
+            break;
+        }
+        default:
+            if (mknod(dst, (st.st_mode & S_IFMT) | S_IRUSR | S_IWUSR, st.st_rdev) < 0) { return -1; }
+            break;
+    }
+    if (copy_attributes(src, dst, &st) < 0) { failed = errno; }
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return 0;
+}
+
+// a handler returns 0 when the command is done, -1 when it failed (and was reported), 1 when the tool has to do it
+
+static int run_rm(char *const *paths) {
+    return unlink(paths[0]) == 0 ? 0 : report("remove", paths[0]);
+}
+
+static int run_rm_r(char *const *paths) {
+    return remove_tree(AT_FDCWD, paths[0]) == 0 ? 0 : report("remove", paths[0]);
+}
+
+static int run_rm_rf(char *const *paths) {
+    return (remove_tree(AT_FDCWD, paths[0]) == 0 || errno == ENOENT) ? 0 : report("remove", paths[0]);
+}
+
+static int run_rmdir(char *const *paths) {
+    return rmdir(paths[0]) == 0 ? 0 : report("remove directory", paths[0]);
+}
+
+static int run_rmdir_ignore_non_empty(char *const *paths) {
+    if (rmdir(paths[0]) == 0 || errno == ENOTEMPTY || errno == EEXIST) { return 0; }
+    return report("remove directory", paths[0]);
+}
+
+static int run_chmod_reference(char *const *paths) {
+    struct stat st;
+    if (stat(paths[0], &st) < 0) { return report("stat", paths[0]); }
+    if (fchmodat(AT_FDCWD, paths[1], st.st_mode & 07777, 0) < 0) { return report("chmod", paths[1]); }
+    return 0;
+}
+
+static int run_mv(char *const *paths) {
+    if (renameat(AT_FDCWD, paths[0], AT_FDCWD, paths[1]) == 0) { return 0; }
+    if (errno == EXDEV) { return 1; } // mv copies across filesystems
+    return report("move", paths[0]);
+}
+
+static int run_ln(char *const *paths) {
+    return linkat(AT_FDCWD, paths[0], AT_FDCWD, paths[1], 0) == 0 ? 0 : report("link", paths[1]);
+}
+
+static int run_cp_a(char *const *paths) {
+    struct stat st;
+    // cp copies into a directory that exists, or over a file: never the case in the scripts written
+    if (lstat(paths[1], &st) == 0 || errno != ENOENT) { return 1; }
+    struct inode_map *links = inode_map_new();
+    if (links == NULL) { return 1; }
+    int ret = copy_tree(paths[0], paths[1], links);
+    inode_map_free(links);
+    return ret == 0 ? 0 : report("copy", paths[0]);
+}
+
+static int run_cp_attributes(char *const *paths) {
+    struct stat src_status, dst_status;
+    // otherwise cp creates the file, or has more to tell about the types
+    if (lstat(paths[0], &src_status) < 0 || lstat(paths[1], &dst_status) < 0) { return 1; }
+    if (!S_ISREG(src_status.st_mode) || !S_ISREG(dst_status.st_mode)) { return 1; }
+    return copy_attributes(paths[0], paths[1], &src_status) == 0 ? 0 : report("copy the attributes of", paths[0]);
+}
+
+// every command a script may have: its words before the paths, the number of paths and how it is done (if at all)
+static const struct {
+    const char *words[3];
+    int paths;
+    int (*run)(char *const *paths);
+} commands[] = {
+    { { "set", "-x" }, 0, NULL },
+    { { "rm" }, 1, run_rm },
+    { { "rm", "-r" }, 1, run_rm_r },
+    { { "rm", "-rf" }, 1, run_rm_rf },
+    { { "rmdir" }, 1, run_rmdir },
+    { { "rmdir", "--ignore-fail-on-non-empty" }, 1, run_rmdir_ignore_non_empty },
+    { { "chmod", "--reference" }, 2, run_chmod_reference },
+    { { "mv", "-T" }, 2, run_mv },
+    { { "ln", "-T" }, 2, run_ln },
+    { { "cp", "-a" }, 2, run_cp_a },
+    { { "cp", "--attributes-only", "--preserve=all" }, 2, run_cp_attributes },
+};
+
+static int find_command(const struct line *l) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        int n = 0;
+        while (n < 3 && commands[i].words[n] != NULL) { n++; }
+        if (l->argc != n + commands[i].paths) { continue; }
+        int k = 0;
+        while (k < n && strcmp(l->argv[k], commands[i].words[k]) == 0) { k++; }
+        if (k == n) { return (int) i; }
+    }
+    return -1;
+}
+
+/*
+ * one pass over the script. without execute, it only checks that every line is known. returns the number of commands
+ * that failed, -1 on a line not known
+ */
+static int script_pass(FILE *script, bool execute) {
+    char *values[NUM_VARS] = { NULL };
+    struct line l = { 0 };
+    char *text = NULL; // the line being split, more than one if a quoted name has newlines
+    size_t text_len = 0, text_size = 0;
+    char *chunk = NULL;
+    size_t chunk_size = 0;
+    ssize_t n;
+    int failed = 0;
+    bool known = true;
+
+    rewind(script);
+    while (known && (n = getline(&chunk, &chunk_size, script)) > 0) {
+        if (text_len + (size_t) n + 1 > text_size) {
+            char *grown = realloc(text, text_len + (size_t) n + 1);
+            if (grown == NULL) { known = false; break; }
+            text = grown;
+            text_size = text_len + (size_t) n + 1;
+        }
+        memcpy(text + text_len, chunk, (size_t) n + 1);
+        text_len += (size_t) n;
+
+        int split_result = split(text, values, &l);
+        if (split_result == SPLIT_MORE) { continue; }
+        text_len = 0;
+        if (split_result == SPLIT_UNKNOWN) { known = false; break; }
+        if (l.argc == 0 || assign(&l, values)) { continue; }
+        int i = find_command(&l);
+        if (i < 0) { known = false; break; }
+        if (!execute) { continue; }
+        if (commands[i].run == NULL) { continue; }
+        throttle(0);
+        int ret = commands[i].run(l.argv + l.argc - commands[i].paths);
+        if (ret > 0) { ret = run_tool(l.argv); }
+        if (ret < 0) { failed++; }
+    }
+    if (text_len > 0 || ferror(script)) { known = false; } // a quote never closed, or not read to the end
+
+    for (int i = 0; i < NUM_VARS; i++) { free(values[i]); }
+    free(l.buf);
+    free(text);
+    free(chunk);
+    return known ? failed : -1;
+}
+
+int execute_script(const char *script_path) {
+    FILE *script = fopen(script_path, "r");
+    if (script == NULL) { return -1; }
+    // everything is checked first, so a script is either run here or by bash, never partly by both
+    int failed = script_pass(script, false);
+    if (failed == 0) { failed = script_pass(script, true); }
+    fclose(script);
+    return failed;
+}
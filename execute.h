@@ -0,0 +1,20 @@
+/*
+ * execute.h / execute.c
+ *
+ * running a script from create_shell_script() (see sh.h) in this process: the commands the actions write are done with
+ * the system calls themselves, instead of a fork and exec of rm, mv, cp or chmod for every line. the script is still
+ * written first and stays the record of what was done. only mv across filesystems, and cp onto a path that exists, run
+ * the real tools
+ */
+
+#ifndef OVERLAYFS_TOOLS_EXECUTE_H
+#define OVERLAYFS_TOOLS_EXECUTE_H
+
+/*
+ * runs every command of the script, going on after one fails as bash would. returns the number of commands that
+ * failed, or -1 if nothing was run because the script cannot be read or has a line this does not know, which is
+ * then left to bash
+ */
+int execute_script(const char *script_path);
+
+#endif //OVERLAYFS_TOOLS_EXECUTE_H
@@ -45,6 +45,7 @@
 #include "check.h"
 #include "mount.h"
 #include "overlayfs.h"
+#include "throttle.h"
 
 extern const char *program_name;
 
@@ -280,11 +281,20 @@ static void usage(void)
 		    "-n,                       make no changes to the filesystem\n"
 		    "-y,                       assume \"yes\" to all questions\n"
 		    "-v, --verbose             print more messages of overlayfs\n"
+		    "    --ionice=CLASS        I/O scheduling class: idle, or best-effort:N\n"
+		    "                          with N from 0 (highest) to 7\n"
+		    "    --max-iops=N          make at most N lookups per second\n"
 		    "-h, --help                display this usage of overlayfs\n"
 		    "-V, --version             display version information\n"));
 	exit(FSCK_USAGE);
 }
 
+/* Long options without a short one */
+enum {
+	OPT_IONICE = 256,
+	OPT_MAX_IOPS,
+};
+
 /* Parse options from user and check correctness */
 static void parse_options(int argc, char *argv[])
 {
@@ -293,11 +303,14 @@ static void parse_options(int argc, char *argv[])
 	int i, c;
 	char **lowerdir = NULL;
 	bool conflict = false;
+	uint64_t max_iops = 0;
 
 	struct option long_options[] = {
 		{"verbose", no_argument, NULL, 'v'},
 		{"version", no_argument, NULL, 'V'},
 		{"help", no_argument, NULL, 'h'},
+		{"ionice", required_argument, NULL, OPT_IONICE},
+		{"max-iops", required_argument, NULL, OPT_MAX_IOPS},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -331,6 +344,21 @@ static void parse_options(int argc, char *argv[])
 		case 'v':
 			flags |= FL_VERBOSE;
 			break;
+		case OPT_IONICE:
+			if (throttle_ionice(optarg)) {
+				print_info(_("I/O scheduling class %s cannot be "
+					     "set: %s\n\n"), optarg,
+					   strerror(errno));
+				goto usage_out;
+			}
+			break;
+		case OPT_MAX_IOPS:
+			if (parse_size(optarg, UINT64_MAX, &max_iops) || !max_iops) {
+				print_info(_("Invalid number of I/O requests "
+					     "per second %s!\n\n"), optarg);
+				goto usage_out;
+			}
+			break;
 		case 'V':
 			version();
 			exit(0);
@@ -341,6 +369,9 @@ static void parse_options(int argc, char *argv[])
 		}
 	}
 
+	/* Only metadata is read, there are no bytes to budget */
+	throttle_limit(0, max_iops);
+
 	/* Resolve and get each underlying directory of overlay filesystem */
 	if (ovl_get_dirs(&config, &lowerdir, &ofs.lower_num,
 			 &ofs.upper_layer.path, &ofs.workdir.path))
@@ -411,6 +442,10 @@ static void fsck_exit(void)
 		print_info(_("Filesystem check failed, may not clean!\n"));
 	}
 
+	if (throttle_enabled())
+		print_info(_("Waited %.1f seconds in total to stay within the "
+			     "I/O budget\n"), throttle_waited());
+
 	if ((exit_value == FSCK_OK) ||
 	    (!(exit_value & FSCK_ERROR) && !(exit_value & FSCK_UNCORRECTED)))
 		print_info(_("Filesystem clean\n"));
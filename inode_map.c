@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "inode_map.h"
+
+enum { SLOT_FREE, SLOT_VERDICT, SLOT_MERGED };
+
+struct inode_slot {
+    unsigned char kind; // SLOT_*
+    bool identical; // SLOT_VERDICT
+    dev_t upper_dev;
+    ino_t upper_ino;
+    dev_t lower_dev; // SLOT_VERDICT
+    ino_t lower_ino;
+    char *lower_path; // SLOT_MERGED
+};
+
+// a name to be linked to the one an inode was merged to, once the traversal is done
+struct inode_link {
+    struct inode_link *next;
+    const char *merged; // the lower_path of a SLOT_MERGED slot
+    char lower_path[];
+};
+
+struct inode_map {
+    pthread_mutex_t lock;
+    struct inode_slot *slots;
+    size_t size; // a power of two
+    size_t count;
+    struct inode_link *links; // newest first
+};
+
+struct inode_map *inode_map_new(void) {
+    struct inode_map *map = malloc(sizeof(struct inode_map));
+    if (map == NULL) { return NULL; }
+    map->size = 256;
+    map->count = 0;
+    map->links = NULL;
+    map->slots = calloc(map->size, sizeof(struct inode_slot));
+    if (map->slots == NULL) { free(map); return NULL; }
+    pthread_mutex_init(&map->lock, NULL);
+    return map;
+}
+
+void inode_map_free(struct inode_map *map) {
+    if (map == NULL) { return; }
+    for (size_t i = 0; i < map->size; i++) { free(map->slots[i].lower_path); }
+    while (map->links != NULL) {
+        struct inode_link *next = map->links->next;
+        free(map->links);
+        map->links = next;
+    }
+    free(map->slots);
+    pthread_mutex_destroy(&map->lock);
+    free(map);
+}
+
+static size_t slot_hash(const struct inode_slot *key) {
+    uint64_t h = (uint64_t) key->kind;
+    h = (h ^ (uint64_t) key->upper_dev) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (uint64_t) key->upper_ino) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (uint64_t) key->lower_dev) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (uint64_t) key->lower_ino) * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h ^ (h >> 29));
+}
+
+static bool slot_equal(const struct inode_slot *a, const struct inode_slot *b) {
+    return a->kind == b->kind && a->upper_dev == b->upper_dev && a->upper_ino == b->upper_ino && a->lower_dev == b->lower_dev && a->lower_ino == b->lower_ino;
+}
+
+// the slot of key, or the free slot where it belongs. call with map->lock held
+static struct inode_slot *slot_find(struct inode_map *map, const struct inode_slot *key) {
+    size_t i = slot_hash(key) & (map->size - 1);
+    while (map->slots[i].kind != SLOT_FREE && !slot_equal(&map->slots[i], key)) {
+        i = (i + 1) & (map->size - 1);
+    }
+    return &map->slots[i];
+}
+
+// makes room for one more slot. call with map->lock held
+static int map_reserve(struct inode_map *map) {
+    if ((map->count + 1) * 4 <= map->size * 3) { return 0; }
+    struct inode_map bigger = { .size = map->size * 2 };
+    bigger.slots = calloc(bigger.size, sizeof(struct inode_slot));
+    if (bigger.slots == NULL) { return -1; }
+    for (size_t i = 0; i < map->size; i++) {
+        if (map->slots[i].kind != SLOT_FREE) { *slot_find(&bigger, &map->slots[i]) = map->slots[i]; }
+    }
+    free(map->slots);
+    map->slots = bigger.slots;
+    map->size = bigger.size;
+    return 0;
+}
+
+static void slot_key(struct inode_slot *key, unsigned char kind, const struct stat *upper_status, const struct stat *lower_status) {
+    memset(key, 0, sizeof(struct inode_slot));
+    key->kind = kind;
+    key->upper_dev = upper_status->st_dev;
+    key->upper_ino = upper_status->st_ino;
+    if (lower_status != NULL) {
+        key->lower_dev = lower_status->st_dev;
+        key->lower_ino = lower_status->st_ino;
+    }
+}
+
+int inode_map_verdict(struct inode_map *map, const struct stat *upper_status, const struct stat *lower_status) {
+    struct inode_slot key;
+    slot_key(&key, SLOT_VERDICT, upper_status, lower_status);
+    pthread_mutex_lock(&map->lock);
+    const struct inode_slot *slot = slot_find(map, &key);
+    int verdict = (slot->kind == SLOT_FREE) ? -1 : slot->identical;
+    pthread_mutex_unlock(&map->lock);
+    return verdict;
+}
+
+void inode_map_set_verdict(struct inode_map *map, const struct stat *upper_status, const struct stat *lower_status, bool identical) {
+    struct inode_slot key;
+    slot_key(&key, SLOT_VERDICT, upper_status, lower_status);
+    key.identical = identical;
+    pthread_mutex_lock(&map->lock);
+    if (map_reserve(map) == 0) { // otherwise it is just not remembered
+        struct inode_slot *slot = slot_find(map, &key);
+        if (slot->kind == SLOT_FREE) { map->count++; }
+        *slot = key;
+    }
+    pthread_mutex_unlock(&map->lock);
+}
+
+const char *inode_map_merged(struct inode_map *map, const struct stat *upper_status, const char *lower_path) {
+    struct inode_slot key;
+    slot_key(&key, SLOT_MERGED, upper_status, NULL);
+    const char *merged = NULL;
+    pthread_mutex_lock(&map->lock);
+    if (map_reserve(map) == 0) {
+        struct inode_slot *slot = slot_find(map, &key);
+        if (slot->kind != SLOT_FREE) {
+            merged = slot->lower_path;
+        } else if ((key.lower_path = strdup(lower_path)) != NULL) {
+            *slot = key;
+            map->count++;
+        }
+    }
+    pthread_mutex_unlock(&map->lock);
+    return merged;
+}
+
+int inode_map_add_link(struct inode_map *map, const char *merged, const char *lower_path) {
+    size_t len = strlen(lower_path);
+    struct inode_link *link = malloc(sizeof(struct inode_link) + len + 1);
+    if (link == NULL) { return -1; }
+    link->merged = merged;
+    memcpy(link->lower_path, lower_path, len + 1);
+    pthread_mutex_lock(&map->lock);
+    link->next = map->links;
+    map->links = link;
+    pthread_mutex_unlock(&map->lock);
+    return 0;
+}
+
+int inode_map_links(struct inode_map *map, int (*fn)(const char *merged, const char *lower_path, void *arg), void *arg) {
+    for (const struct inode_link *link = map->links; link != NULL; link = link->next) {
+        int ret = fn(link->merged, link->lower_path, arg);
+        if (ret != 0) { return ret; }
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * inode_map.h / inode_map.c
+ *
+ * what the traversal learned about hard linked inodes, so their other names are not read again. thread safe
+ */
+
+#ifndef OVERLAYFS_TOOLS_INODE_MAP_H
+#define OVERLAYFS_TOOLS_INODE_MAP_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+struct inode_map;
+
+struct inode_map *inode_map_new(void);
+
+void inode_map_free(struct inode_map *map);
+
+/*
+ * whether the contents of the upper and lower inodes were found identical: 1 or 0, -1 if not compared yet
+ */
+int inode_map_verdict(struct inode_map *map, const struct stat *upper_status, const struct stat *lower_status);
+
+void inode_map_set_verdict(struct inode_map *map, const struct stat *upper_status, const struct stat *lower_status, bool identical);
+
+/*
+ * the lower path the upper inode has been merged to under another name. if there is none yet, lower_path is
+ * remembered as that and NULL is returned (also when out of memory). the result stays valid until inode_map_free()
+ */
+const char *inode_map_merged(struct inode_map *map, const struct stat *upper_status, const char *lower_path);
+
+/*
+ * remembers that lower_path is to become another name of merged, as returned by inode_map_merged(), once the
+ * traversal is done. -1 when out of memory
+ */
+int inode_map_add_link(struct inode_map *map, const char *merged, const char *lower_path);
+
+/*
+ * calls fn for every link added, in no particular order, until one returns something else than 0, which is returned.
+ * not thread safe: call it once the traversal is done
+ */
+int inode_map_links(struct inode_map *map, int (*fn)(const char *merged, const char *lower_path, void *arg), void *arg);
+
+#endif //OVERLAYFS_TOOLS_INODE_MAP_H
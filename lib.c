@@ -29,15 +29,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
-#include <fts.h>
 
 #include "common.h"
 #include "lib.h"
 #include "path.h"
+#include "dir.h"
+#include "throttle.h"
 
 extern int flags;
 extern int status;
 
+/* Bumped by every xattr change, so names listed before are listed again */
+static unsigned int xattr_generation;
+
 static int ask_yn(const char *question, int def)
 {
 	char ans[16];
@@ -78,20 +82,12 @@ int ask_question(const char *question, int def)
  *
  * Return: a nonnegative value on success, -1 otherwise
  */
-ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
-		  char **value, bool *exist)
+static ssize_t fget_xattr(int fd, const char *pathname, const char *xattrname,
+			  char **value, bool *exist)
 {
 	char *buf = NULL;
-	int fd;
 	ssize_t ret;
 
-	fd = openat(dirfd, pathname, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
-	if (fd < 0) {
-		print_err(_("Failed to openat %s: %s\n"),
-			    pathname, strerror(errno));
-		return -1;
-	}
-
 	ret = fgetxattr(fd, xattrname, NULL, 0);
 	if (ret < 0) {
 		if (errno != ENODATA && errno != ENOTSUP)
@@ -116,7 +112,6 @@ ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
 	buf[ret] = '\0';
 	*value = buf;
 out:
-	close(fd);
 	return ret;
 
 fail2:
@@ -127,6 +122,100 @@ fail:
 	goto out;
 }
 
+ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
+		  char **value, bool *exist)
+{
+	int fd;
+	ssize_t ret;
+
+	fd = openat(dirfd, pathname, O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+	if (fd < 0) {
+		print_err(_("Failed to openat %s: %s\n"),
+			    pathname, strerror(errno));
+		return -1;
+	}
+
+	ret = fget_xattr(fd, pathname, xattrname, value, exist);
+	close(fd);
+	return ret;
+}
+
+/* List the xattr names of the scanned entry, if not listed since the last change */
+static void scan_entry_list(struct scan_entry *se)
+{
+	ssize_t len;
+
+	if (se->names && se->generation == xattr_generation)
+		return;
+
+	free(se->names);
+	se->names = NULL;
+	se->generation = xattr_generation;
+	len = flistxattr(se->fd, NULL, 0);
+	if (len < 0) {
+		/* No xattr support: get_xattr() takes them as missing */
+		if (errno == ENOTSUP) {
+			se->names = smalloc(1);
+			se->names_len = 0;
+		}
+		return;
+	}
+	se->names = smalloc(len + 1);
+	se->names_len = flistxattr(se->fd, se->names, len);
+	if (se->names_len < 0) {
+		/* Changed meanwhile, read each xattr on its own */
+		free(se->names);
+		se->names = NULL;
+	}
+}
+
+static bool scan_entry_has(const struct scan_entry *se, const char *xattrname)
+{
+	const char *name;
+
+	for (name = se->names; name < se->names + se->names_len;
+	     name += strlen(name) + 1) {
+		if (!strcmp(name, xattrname))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * get_xattr() of the entry being scanned, through its handle. An xattr
+ * missing from the names listed is answered without a syscall.
+ */
+ssize_t scan_get_xattr(struct scan_ctx *sctx, const char *xattrname,
+		       char **value, bool *exist)
+{
+	struct scan_entry *se = sctx->entry;
+
+	if (se->fd < 0) {
+		se->fd = openat(se->dirfd, sctx->filename,
+				O_CLOEXEC|O_NONBLOCK|O_NOFOLLOW|O_RDONLY);
+		if (se->fd < 0) {
+			print_err(_("Failed to openat %s: %s\n"),
+				    sctx->pathname, strerror(errno));
+			return -1;
+		}
+	}
+
+	scan_entry_list(se);
+	if (se->names && !scan_entry_has(se, xattrname)) {
+		if (exist)
+			*exist = false;
+		return 0;
+	}
+	return fget_xattr(se->fd, sctx->pathname, xattrname, value, exist);
+}
+
+static void scan_entry_release(struct scan_entry *se)
+{
+	if (se->own_fd && se->fd >= 0)
+		close(se->fd);
+	free(se->names);
+}
+
 /*
  * Set the value of the specified xattr
  *
@@ -147,6 +236,7 @@ int set_xattr(int dirfd, const char *pathname, const char *xattrname,
 		return -1;
 	}
 
+	xattr_generation++;
 	ret = fsetxattr(fd, xattrname, value, size, XATTR_CREATE);
 	if (ret && errno != EEXIST)
 		goto fail;
@@ -179,6 +269,7 @@ int remove_xattr(int dirfd, const char *pathname, const char *xattrname)
 		return -1;
 	}
 
+	xattr_generation++;
 	ret = fremovexattr(fd, xattrname);
 	if (ret)
 		print_err(_("Cannot fremovexattr %s %s: %s\n"), pathname,
@@ -189,11 +280,24 @@ int remove_xattr(int dirfd, const char *pathname, const char *xattrname)
 }
 
 
-static void scan_entry_init(struct scan_ctx *sctx, FTSENT *ftsent)
+/* State of one scan_dir() walk */
+struct scan_walk {
+	struct scan_ctx *sctx;
+	struct scan_operations *sop;
+	char *path;		/* relative to the layer root, "" for the root */
+	size_t len;
+	size_t size;
+	int level;
+};
+
+static void scan_entry_init(struct scan_walk *sw, const char *name,
+			    struct stat *st)
 {
-	sctx->pathname = basename2(ftsent->fts_path, sctx->layer->path);
-	sctx->filename = ftsent->fts_name;
-	sctx->st = ftsent->fts_statp;
+	struct scan_ctx *sctx = sw->sctx;
+
+	sctx->pathname = sw->len ? sw->path : ".";
+	sctx->filename = name;
+	sctx->st = st;
 }
 
 static inline int scan_check_entry(int (*do_check)(struct scan_ctx *),
@@ -202,93 +306,186 @@ static inline int scan_check_entry(int (*do_check)(struct scan_ctx *),
 	return do_check ? do_check(sctx) : 0;
 }
 
+/* Append "/name" (just "name" at the root), return the old length */
+static ssize_t scan_path_push(struct scan_walk *sw, const char *name)
+{
+	size_t old = sw->len;
+	size_t need = sw->len + strlen(name) + 2;
+
+	if (need > sw->size) {
+		sw->size = need * 2;
+		sw->path = srealloc(sw->path, sw->size);
+	}
+	if (sw->len)
+		sw->path[sw->len++] = '/';
+	strcpy(sw->path + sw->len, name);
+	sw->len += strlen(name);
+	return old;
+}
+
+static void scan_path_pop(struct scan_walk *sw, size_t len)
+{
+	sw->len = len;
+	sw->path[len] = '\0';
+}
+
+static int scan_subdir(struct scan_walk *sw, int dirfd, const char *name,
+		       struct stat *st);
+
 /*
- * Scan specified directories and invoke callback to check/fix underlying
- * dirs of overlay filesystem
+ * Scan one entry of the directory dirfd, its path is already in sw. Only
+ * entries that could be whiteouts are stat()ed, for the others the type
+ * from the directory listing is enough.
  */
-int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop)
+static int scan_entry(struct scan_walk *sw, int dirfd, const char *name,
+		      unsigned char type)
 {
-	char *paths[2] = {sctx->layer->path, NULL};
-	FTS *ftsp;
-	FTSENT *ftsent;
+	struct scan_ctx *sctx = sw->sctx;
+	struct scan_operations *sop = sw->sop;
+	struct scan_entry se = { .dirfd = dirfd, .fd = -1, .own_fd = true };
+	struct stat st = {0};
 	int ret = 0;
 
-	ftsp = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
-	if (ftsp == NULL) {
-		print_err(_("Failed to fts open %s:%s\n"),
-			    sctx->layer->path, strerror(errno));
+	/* One request for the lookups of the entry, whatever its checks do */
+	throttle(0);
+
+	st.st_mode = dir_type_mode(type);
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) &&
+	    !S_ISLNK(st.st_mode)) {
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			print_err(_("Failed to stat %s/%s:%s\n"),
+				    sctx->layer->path, sw->path, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (S_ISDIR(st.st_mode))
+		return scan_subdir(sw, dirfd, name, &st);
+
+	scan_entry_init(sw, name, &st);
+	sctx->entry = &se;
+	print_debug(_("Scan:%-3s %2d   %-40s %-20s\n"),
+		      S_ISREG(st.st_mode) ? "f" :
+		      S_ISLNK(st.st_mode) ? "sl" : "df",
+		      sw->level, sw->path, sctx->layer->path);
+
+	if (S_ISREG(st.st_mode)) {
+		sctx->result.files++;
+
+		/* Check impurities */
+		ret = scan_check_entry(sop->impurity, sctx);
+	} else if (!S_ISLNK(st.st_mode)) {
+		/* Check whiteouts */
+		ret = scan_check_entry(sop->whiteout, sctx);
+	}
+	scan_entry_release(&se);
+	sctx->entry = NULL;
+	return ret;
+}
+
+/*
+ * Scan directory name in dirfd and everything below it, its path is
+ * already in sw.
+ */
+static int scan_subdir(struct scan_walk *sw, int dirfd, const char *name,
+		       struct stat *st)
+{
+	struct scan_ctx *sctx = sw->sctx;
+	struct scan_operations *sop = sw->sop;
+	struct scan_dir_data *parent = sctx->dirdata;
+	struct scan_entry se = { .dirfd = dirfd, .fd = -1 };
+	struct dir_stream ds;
+	struct dir_entry ent;
+	size_t len;
+	int fd;
+	int ret;
+
+	scan_entry_init(sw, name, st);
+	print_debug(_("Scan:%-3s %2d   %-40s %-20s\n"), "d", sw->level,
+		      sctx->pathname, sctx->layer->path);
+
+	sctx->result.directories++;
+
+	/* The fd read below is the handle of the checks of the directory too */
+	fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0 || dir_open(&ds, fd)) {
+		print_err(_("Failed to read dir %s/%s:%s\n"),
+			    sctx->layer->path, sctx->pathname, strerror(errno));
 		return -1;
 	}
+	se.fd = fd;
+	sctx->entry = &se;
+
+	/* Check redirect xattr */
+	ret = scan_check_entry(sop->redirect, sctx);
+	if (ret)
+		goto out_close;
 
-	while ((ftsent = fts_read(ftsp)) != NULL) {
-		/* Fillup base context */
-		scan_entry_init(sctx, ftsent);
-
-		print_debug(_("Scan:%-3s %2d %7lld   %-40s %-20s\n"),
-			      (ftsent->fts_info == FTS_D) ? "d" :
-			      (ftsent->fts_info == FTS_DNR) ? "dnr" :
-			      (ftsent->fts_info == FTS_DP) ? "dp" :
-			      (ftsent->fts_info == FTS_F) ? "f" :
-			      (ftsent->fts_info == FTS_NS) ? "ns" :
-			      (ftsent->fts_info == FTS_SL) ? "sl" :
-			      (ftsent->fts_info == FTS_SLNONE) ? "sln" :
-			      (ftsent->fts_info == FTS_DEFAULT) ? "df" : "???",
-			      ftsent->fts_level,
-			      (long long)ftsent->fts_statp->st_size,
-			      ftsent->fts_path, sctx->layer->path);
-
-		switch (ftsent->fts_info) {
-		case FTS_F:
-			sctx->result.files++;
-
-			/* Check impurities */
-			ret = scan_check_entry(sop->impurity, sctx);
-			if (ret)
-			        goto out;
-			break;
-		case FTS_DEFAULT:
-			/* Check whiteouts */
-			ret = scan_check_entry(sop->whiteout, sctx);
-			if (ret)
-				goto out;
-			break;
-		case FTS_D:
-			sctx->result.directories++;
-
-			/* Check redirect xattr */
-			ret = scan_check_entry(sop->redirect, sctx);
-			if (ret)
-				goto out;
-
-			/* Check impurities */
-			ret = scan_check_entry(sop->impurity, sctx);
-			if (ret)
-				goto out;
-
-			/* Save current dir data and create new one for subdir */
-			ftsent->fts_pointer = sctx->dirdata;
-			sctx->dirdata = smalloc(sizeof(struct scan_dir_data));
-			break;
-		case FTS_DP:
-			/* Check impure xattr */
-			ret = scan_check_entry(sop->impure, sctx);
-			if (ret)
-				goto out;
-
-			/* Restore parent's dir data */
-			free(sctx->dirdata);
-			sctx->dirdata = ftsent->fts_pointer;
-			break;
-		case FTS_NS:
-		case FTS_DNR:
-		case FTS_ERR:
-			print_err(_("Failed to fts read %s:%s\n"),
-				    ftsent->fts_path, strerror(ftsent->fts_errno));
-			ret = -1;
+	/* Check impurities */
+	ret = scan_check_entry(sop->impurity, sctx);
+	if (ret)
+		goto out_close;
+
+	/* Save current dir data and create new one for subdir */
+	sctx->dirdata = smalloc(sizeof(struct scan_dir_data));
+
+	sw->level++;
+	while ((ret = dir_read(&ds, &ent)) > 0) {
+		len = scan_path_push(sw, ent.name);
+		ret = scan_entry(sw, ds.fd, ent.name, ent.type);
+		scan_path_pop(sw, len);
+		if (ret)
 			goto out;
-		}
 	}
+	if (ret < 0) {
+		print_err(_("Failed to read dir %s/%s:%s\n"),
+			    sctx->layer->path, sw->len ? sw->path : ".",
+			    strerror(errno));
+		goto out;
+	}
+
+	/* Check impure xattr */
+	scan_entry_init(sw, name, st);
+	sctx->entry = &se;
+	print_debug(_("Scan:%-3s %2d   %-40s %-20s\n"), "dp", sw->level - 1,
+		      sctx->pathname, sctx->layer->path);
+	ret = scan_check_entry(sop->impure, sctx);
 out:
-	fts_close(ftsp);
+	sw->level--;
+
+	/* Restore parent's dir data */
+	free(sctx->dirdata);
+	sctx->dirdata = parent;
+out_close:
+	scan_entry_release(&se);
+	sctx->entry = NULL;
+	dir_close(&ds);
+	return ret;
+}
+
+/*
+ * Scan specified directories and invoke callback to check/fix underlying
+ * dirs of overlay filesystem
+ */
+int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop)
+{
+	struct scan_walk sw = {
+		.sctx = sctx,
+		.sop = sop,
+		.size = 256,
+	};
+	struct stat st;
+	int ret;
+
+	if (fstat(sctx->layer->fd, &st)) {
+		print_err(_("Failed to stat %s:%s\n"),
+			    sctx->layer->path, strerror(errno));
+		return -1;
+	}
+
+	sw.path = smalloc(sw.size);
+	ret = scan_subdir(&sw, sctx->layer->fd, ".", &st);
+	free(sw.path);
 	return ret;
 }
+
@@ -91,6 +91,20 @@ struct scan_result {
 	int m_impure;		/* missing inpure dirs */
 };
 
+/*
+ * Handle of the entry being scanned, shared by all checks of it: opened
+ * once, and its xattr names listed once, so asking whether it has one of
+ * the overlay xattrs (mostly not) costs no syscall.
+ */
+struct scan_entry {
+	int dirfd;		/* parent directory */
+	int fd;			/* opened on demand, -1 if not (yet) */
+	bool own_fd;		/* fd is closed by scan_entry_release() */
+	char *names;		/* xattr names from flistxattr(2), NULL if not listed */
+	ssize_t names_len;
+	unsigned int generation;	/* of the xattrs when listed */
+};
+
 struct scan_ctx {
 	struct ovl_fs *ofs;		/* scan ovl fs */
 	struct ovl_layer *layer;	/* scan layer */
@@ -98,8 +112,10 @@ struct scan_ctx {
 
 	const char *pathname;	/* path relative to overlay root */
 	const char *filename;	/* filename */
-	struct stat *st;	/* file stat */
+	struct stat *st;	/* file stat, only st_mode is filled in for
+				   directories, regular files and symlinks */
 	struct scan_dir_data *dirdata;	/* parent dir data of current (could be null) */
+	struct scan_entry *entry;	/* handle of current */
 };
 
 /* Directories scan callback operations struct */
@@ -130,6 +146,8 @@ int scan_dir(struct scan_ctx *sctx, struct scan_operations *sop);
 int ask_question(const char *question, int def);
 ssize_t get_xattr(int dirfd, const char *pathname, const char *xattrname,
 		  char **value, bool *exist);
+ssize_t scan_get_xattr(struct scan_ctx *sctx, const char *xattrname,
+		       char **value, bool *exist);
 int set_xattr(int dirfd, const char *pathname, const char *xattrname,
 	      void *value, size_t size);
 int remove_xattr(int dirfd, const char *pathname, const char *xattrname);
@@ -8,10 +8,25 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/xattr.h>
-#include <fts.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "logic.h"
 #include "sh.h"
+#include "pool.h"
+#include "dir.h"
+#include "uring.h"
+#include "inode_map.h"
+#include "compare.h"
+#include "digest.h"
+#include "manifest.h"
+#include "uncached.h"
+#include "throttle.h"
 
 // exactly the same as in linux/fs.h
 #define WHITEOUT_DEV 0
@@ -25,6 +40,9 @@ const char *ovl_metacopy_xattr = "trusted.overlay.metacopy";
 
 #define TRAILING_SLASH(ftype) (((ftype) == S_IFDIR) ? "/" : "")
 
+// set by an FTS_D callback (like fts_set(FTS_SKIP)) to not descend into that directory
+#define TRAVERSE_SKIP 1
+
 static inline mode_t file_type(const struct stat *status) {
     return status->st_mode & S_IFMT;
 }
@@ -63,42 +81,172 @@ static inline mode_t permission_bits(const struct stat *status) { // not used ye
     return status->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
 }
 
-int is_opaque(const char *path, bool *output) {
+/*
+ * one upper entry and its lower counterpart. both are addressed relative to their (open) parent directories, so
+ * looking them up costs the same at any depth. the full paths are only kept for messages and script commands.
+ */
+struct traverse_entry {
+    const char *lower_path;
+    const char *upper_path;
+    size_t lower_root_len;
+    int lower_dirfd; // parent of the lower counterpart, -1 if that does not exist
+    const char *lower_name;
+    int upper_dirfd;
+    const char *upper_name;
+    int upper_fd; // the upper entry itself, opened on demand by entry_upper_fd(), -1 if not (yet) opened
+    mode_t lower_type; // S_IFMT bits of the lower counterpart, 0 if it does not exist
+    bool lower_stat_valid;
+    struct stat lower_status; // only valid with lower_stat_valid, use entry_lower_status()
+    mode_t upper_type; // S_IFMT bits, known from the directory listing
+    bool upper_stat_valid;
+    struct stat upper_status; // only valid with upper_stat_valid, use entry_upper_status()
+    unsigned char xattr_known; // XATTR_* probed ahead by the io_uring backend, or looked up already for this entry
+    unsigned char xattr_set; // XATTR_* found set among xattr_known
+    bool xattr_listed; // entry_list_xattrs() has run
+    unsigned char content; // CONTENT_*, compared ahead in inode order mode
+    struct inode_map *inodes; // shared by the whole traversal, NULL if it could not be allocated
+    struct compare_pool *compare_pool; // splits the comparison of large files, NULL for none
+    const struct manifest *manifest; // of lowerdir, NULL for none
+};
+
+enum { XATTR_OPAQUE = 1, XATTR_REDIRECT = 2, XATTR_METACOPY = 4, XATTR_ALL = 7 };
+
+// room for the xattr names of most entries: SELinux labels, ACLs and the overlay xattrs take a few hundred bytes
+#define XATTR_LIST_SIZE 1024
+
+enum { CONTENT_UNKNOWN = 0, CONTENT_SAME, CONTENT_DIFFERENT };
+
+// the full status of the lower counterpart, which must exist. in merge-join mode only its type is known up front
+static const struct stat *entry_lower_status(struct traverse_entry *e) {
+    if (!e->lower_stat_valid) {
+        if (fstatat(e->lower_dirfd, e->lower_name, &e->lower_status, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "Failed to stat %s.\n", e->lower_path);
+            return NULL;
+        }
+        e->lower_stat_valid = true;
+    }
+    return &e->lower_status;
+}
+
+// the full status of the upper entry. most entries are never stat()ed: the directory listing tells their type
+static const struct stat *entry_upper_status(struct traverse_entry *e) {
+    if (!e->upper_stat_valid) {
+        int ret = (e->upper_fd >= 0) ? fstat(e->upper_fd, &e->upper_status) : fstatat(e->upper_dirfd, e->upper_name, &e->upper_status, AT_SYMLINK_NOFOLLOW);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to stat %s.\n", e->upper_path);
+            return NULL;
+        }
+        e->upper_stat_valid = true;
+    }
+    return &e->upper_status;
+}
+
+static int entry_upper_fd(struct traverse_entry *e) {
+    if (e->upper_fd < 0) {
+        e->upper_fd = openat(e->upper_dirfd, e->upper_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+        if (e->upper_fd < 0) {
+            fprintf(stderr, "File %s can not be opened: %s\n", e->upper_path, strerror(errno));
+        }
+    }
+    return e->upper_fd;
+}
+
+/*
+ * the xattrs of an entry are looked up once, whichever callbacks ask, and in which order: one flistxattr() tells which
+ * of the overlay xattrs the upper entry has at all (most have none), and only those present are read, each on its
+ * own. the list is complete here, as the trusted.* names are only hidden from unprivileged processes, and the actions
+ * refuse to run as such (see check_xattr_trusted())
+ */
+static void entry_list_xattrs(struct traverse_entry *e, int fd) {
+    if (e->xattr_listed || (e->xattr_known & XATTR_ALL) == XATTR_ALL) { return; }
+    e->xattr_listed = true;
+    char list[XATTR_LIST_SIZE];
+    ssize_t len = flistxattr(fd, list, sizeof(list));
+    if (len < 0) { return; } // too many names to list here, or no xattr support: each one is read on its own
+    unsigned char present = 0;
+    for (const char *name = list; name < list + len; name += strlen(name) + 1) {
+        if (strcmp(name, ovl_opaque_xattr) == 0) {
+            present |= XATTR_OPAQUE;
+        } else if (strcmp(name, ovl_redirect_xattr) == 0) {
+            present |= XATTR_REDIRECT;
+        } else if (strcmp(name, ovl_metacopy_xattr) == 0) {
+            present |= XATTR_METACOPY;
+        }
+    }
+    e->xattr_known |= XATTR_ALL & ~present;
+}
+
+static inline void entry_xattr_known(struct traverse_entry *e, unsigned char xattr, bool set) {
+    e->xattr_known |= xattr;
+    if (set) { e->xattr_set |= xattr; }
+}
+
+int is_opaque(struct traverse_entry *e, bool *output) {
     char val;
-    ssize_t res = getxattr(path, ovl_opaque_xattr, &val, 1);
+    if (!(e->xattr_known & XATTR_OPAQUE)) {
+        int fd = entry_upper_fd(e);
+        if (fd < 0) { return -1; }
+        entry_list_xattrs(e, fd);
+    }
+    if (e->xattr_known & XATTR_OPAQUE) {
+        *output = e->xattr_set & XATTR_OPAQUE;
+        return 0;
+    }
+    ssize_t res = fgetxattr(e->upper_fd, ovl_opaque_xattr, &val, 1);
     if ((res < 0) && (errno != ENODATA)) {
         return -1;
     }
     *output = (res == 1 && val == 'y');
+    entry_xattr_known(e, XATTR_OPAQUE, *output);
     return 0;
 }
 
-int is_redirect(const char *path, bool *output) {
-    ssize_t res = getxattr(path, ovl_redirect_xattr, NULL, 0);
+int is_redirect(struct traverse_entry *e, bool *output) {
+    if (!(e->xattr_known & XATTR_REDIRECT)) {
+        int fd = entry_upper_fd(e);
+        if (fd < 0) { return -1; }
+        entry_list_xattrs(e, fd);
+    }
+    if (e->xattr_known & XATTR_REDIRECT) {
+        *output = e->xattr_set & XATTR_REDIRECT;
+        return 0;
+    }
+    ssize_t res = fgetxattr(e->upper_fd, ovl_redirect_xattr, NULL, 0);
     if ((res < 0) && (errno != ENODATA)) {
-        fprintf(stderr, "File %s redirect xattr can not be read.\n", path);
+        fprintf(stderr, "File %s redirect xattr can not be read.\n", e->upper_path);
         return -1;
     }
     *output = (res > 0);
+    entry_xattr_known(e, XATTR_REDIRECT, *output);
     return 0;
 }
 
-int is_metacopy(const char *path, bool *output) {
-    ssize_t res = getxattr(path, ovl_metacopy_xattr, NULL, 0);
+int is_metacopy(struct traverse_entry *e, bool *output) {
+    if (!(e->xattr_known & XATTR_METACOPY)) {
+        int fd = entry_upper_fd(e);
+        if (fd < 0) { return -1; }
+        entry_list_xattrs(e, fd);
+    }
+    if (e->xattr_known & XATTR_METACOPY) {
+        *output = e->xattr_set & XATTR_METACOPY;
+        return 0;
+    }
+    ssize_t res = fgetxattr(e->upper_fd, ovl_metacopy_xattr, NULL, 0);
     if ((res < 0) && (errno != ENODATA)) {
-        fprintf(stderr, "File %s metacopy xattr can not be read.\n", path);
+        fprintf(stderr, "File %s metacopy xattr can not be read.\n", e->upper_path);
         return -1;
     }
     *output = (res >= 0);
+    entry_xattr_known(e, XATTR_METACOPY, *output);
     return 0;
 }
 
 // Treat redirect as opaque dir because it hides the tree in lower_path
 // and we do not support following to redirected lower path
-int is_opaquedir(const char *path, bool *output) {
+int is_opaquedir(struct traverse_entry *e, bool *output) {
     bool opaque, redirect;
-    if (is_opaque(path, &opaque) < 0) { return -1; }
-    if (is_redirect(path, &redirect) < 0) { return -1; }
+    if (is_opaque(e, &opaque) < 0) { return -1; }
+    if (is_redirect(e, &redirect) < 0) { return -1; }
     *output = opaque || redirect;
     return 0;
 }
@@ -107,482 +255,2091 @@ bool permission_identical(const struct stat *lower_status, const struct stat *up
     return (permission_bits(lower_status) == permission_bits(upper_status)) && (lower_status->st_uid == upper_status->st_uid) && (lower_status->st_gid == upper_status->st_gid);
 }
 
-int read_chunk(int fd, char *buf, int len) {
-    ssize_t ret;
-    ssize_t remain = len;
-    while (remain > 0 && (ret = read(fd, buf, remain)) != 0) {
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
+static int entry_permission_identical(struct traverse_entry *e, bool *output) {
+    const struct stat *lower_status = entry_lower_status(e);
+    if (lower_status == NULL) { return -1; }
+    const struct stat *upper_status = entry_upper_status(e);
+    if (upper_status == NULL) { return -1; }
+    *output = permission_identical(lower_status, upper_status);
+    return 0;
+}
+
+// smaller files are cheaper to read than to look up and keep a digest for
+#define DIGEST_MIN_SIZE ((off_t) 64 << 10)
+
+/*
+ * compare_files(), with the digest cache: an upper file whose cached digest was set while identical to the lower file,
+ * as it still is, decides without reading either. files found identical by reading them in full get that cached
+ */
+static int compare_cached(int lower_file, int upper_file, off_t size, struct compare_pool *pool, bool *output) {
+    struct stat lower_status, upper_status;
+    if (!digest_cache || size < DIGEST_MIN_SIZE || fstat(lower_file, &lower_status) != 0 || fstat(upper_file, &upper_status) != 0) {
+        return compare_files(lower_file, upper_file, size, pool, output, NULL, NULL);
+    }
+    if (digest_identical(upper_file, &upper_status, &lower_status)) {
+        *output = true;
+        return COMPARED;
+    }
+    // hashed as it is read for the comparison. where it is mapped instead (from the page cache then) or split over the
+    // pool, it is read again afterwards
+    struct digest_stream *stream = digest_stream_new();
+    struct compare_feed feed = { digest_stream_update, stream, 0 };
+    bool read_all;
+    int return_val = compare_files(lower_file, upper_file, size, pool, output, &read_all, (stream != NULL) ? &feed : NULL);
+    if (return_val == COMPARED && *output && read_all) {
+        digest_set_identical(upper_file, &upper_status, lower_file, &lower_status, (feed.next == size) ? stream : NULL);
+    }
+    digest_stream_free(stream);
+    return return_val;
+}
+
+/*
+ * compares the digest the lower manifest has for the lower file with that of the upper file, so lowerdir is not read
+ * at all. returns 1 if the manifest does not know the lower file, or not as it is now: it is compared as usual then
+ */
+static int manifest_identical(struct traverse_entry *e, const struct stat *lower_status, bool *output) {
+    const struct manifest_entry *m = manifest_find(e->manifest, &e->lower_path[e->lower_root_len], lower_status);
+    if (m == NULL || !(m->flags & MANIFEST_DIGEST)) { return 1; }
+    int upper_file = entry_upper_fd(e);
+    if (upper_file < 0) { return -1; }
+    struct stat upper_status;
+    bool cached = digest_cache && lower_status->st_size >= DIGEST_MIN_SIZE && fstat(upper_file, &upper_status) == 0;
+    unsigned char digest[DIGEST_SIZE];
+    if (!cached || !digest_get(upper_file, &upper_status, digest)) {
+        if (digest_file(upper_file, digest) != 0) {
+            fprintf(stderr, "Error occured when reading file %s.\n", e->upper_path);
             return -1;
         }
-        remain -= ret;
-        buf += ret;
+        if (cached) { digest_set(upper_file, &upper_status, digest); }
     }
-    return len - remain;
+    *output = (memcmp(digest, m->digest, DIGEST_SIZE) == 0);
+    return 0;
 }
 
-int regular_file_identical(const char *lower_path, const struct stat *lower_status, const char *upper_path, const struct stat *upper_status, bool *output) {
-    size_t blksize = (size_t) MIN(lower_status->st_blksize, upper_status->st_blksize);
+int regular_file_identical(struct traverse_entry *e, bool *output) {
+    if (e->content != CONTENT_UNKNOWN) {
+        // compared ahead, before it was known whether the upper file is a metacopy (which is handled below)
+        bool metacopy;
+        if (is_metacopy(e, &metacopy) < 0) { return -1; }
+        if (!metacopy) {
+            *output = (e->content == CONTENT_SAME);
+            return 0;
+        }
+    }
+    const struct stat *lower_status = entry_lower_status(e);
+    if (lower_status == NULL) { return -1; }
+    const struct stat *upper_status = entry_upper_status(e);
+    if (upper_status == NULL) { return -1; }
     if (lower_status->st_size != upper_status->st_size) { // different sizes
         *output = false;
         return 0;
     }
     bool metacopy, redirect;
-    if (is_metacopy(upper_path, &metacopy) < 0) { return -1; }
-    if (is_redirect(upper_path, &redirect) < 0) { return -1; }
+    if (is_metacopy(e, &metacopy) < 0) { return -1; }
+    if (is_redirect(e, &redirect) < 0) { return -1; }
     if (metacopy) {
 	    // metacopy means data is indentical, but redirect means it is not identical to lower_path
 	    *output = !redirect;
 	    return 0;
     }
-    char lower_buffer[blksize];
-    char upper_buffer[blksize];
-    int lower_file = open(lower_path, O_RDONLY);
-    int upper_file = open(upper_path, O_RDONLY);
+    // hard links: another name of the same pair of inodes may have been compared already
+    bool linked = e->inodes != NULL && upper_status->st_nlink > 1 && lower_status->st_nlink > 1;
+    if (linked) {
+        int verdict = inode_map_verdict(e->inodes, upper_status, lower_status);
+        if (verdict >= 0) {
+            *output = verdict;
+            return 0;
+        }
+    }
+    if (e->manifest != NULL) {
+        int return_val = manifest_identical(e, lower_status, output);
+        if (return_val <= 0) {
+            if (return_val == 0 && linked) { inode_map_set_verdict(e->inodes, upper_status, lower_status, *output); }
+            return return_val;
+        }
+    }
+    int upper_file = entry_upper_fd(e); // already opened for the xattrs above, closed by traverse()
+    int lower_file = openat(e->lower_dirfd, e->lower_name, O_RDONLY | O_CLOEXEC);
     if (lower_file < 0) {
-        fprintf(stderr, "File %s can not be read for content: %s\n", lower_path, strerror(errno));
+        fprintf(stderr, "File %s can not be read for content: %s\n", e->lower_path, strerror(errno));
         return -1;
     }
-    if (upper_file < 0) {
-        fprintf(stderr, "File %s can not be read for content: %s\n", upper_path, strerror(errno));
-        return -1;
+    int return_val = 0;
+    switch (compare_cached(lower_file, upper_file, lower_status->st_size, e->compare_pool, output)) {
+        case LOWER_READ_ERROR:
+            fprintf(stderr, "Error occured when reading file %s.\n", e->lower_path);
+            return_val = -1;
+            break;
+        case UPPER_READ_ERROR:
+            fprintf(stderr, "Error occured when reading file %s.\n", e->upper_path);
+            return_val = -1;
+            break;
+        case SIZE_MISMATCH:
+            fprintf(stderr, "Unexpected size difference: %s.\n", e->upper_path);
+            return_val = -1;
+            break;
     }
-    ssize_t read_lower; ssize_t read_upper;
-    do { // we can assume one will not reach EOF earlier than the other, as the file sizes are checked to be the same earlier
-        read_lower = read_chunk(lower_file, lower_buffer, blksize);
-        read_upper = read_chunk(upper_file, upper_buffer, blksize);
-        if (read_lower < 0) {
-            fprintf(stderr, "Error occured when reading file %s.\n", lower_path);
-            return -1;
-        }
-        if (read_upper < 0) {
-            fprintf(stderr, "Error occured when reading file %s.\n", upper_path);
-            return -1;
-        }
-        if (read_upper != read_lower) { // this should not happen as we've checked the sizes
-            fprintf(stderr, "Unexpected size difference: %s.\n", upper_path);
-            return -1;
+    if (return_val == 0 && linked) { inode_map_set_verdict(e->inodes, upper_status, lower_status, *output); }
+    if (close(lower_file)) { return -1; }
+    return return_val;
+}
+
+// returns a malloc()ed, NUL-terminated target, or NULL on error. size_hint is st_size of the link
+static char *read_link(int dirfd, const char *name, off_t size_hint) {
+    size_t size = (size_hint > 0) ? (size_t) size_hint + 1 : 256;
+    for (;;) {
+        char *buffer = malloc(size);
+        if (buffer == NULL) { return NULL; }
+        ssize_t len = readlinkat(dirfd, name, buffer, size);
+        if (len < 0) { free(buffer); return NULL; }
+        if ((size_t) len < size) {
+            buffer[len] = '\0';
+            return buffer;
         }
-        if (memcmp(lower_buffer, upper_buffer, read_upper)) { *output = false; return 0; } // the output is by default false, but we still set it for ease of reading
-    } while (read_lower || read_upper);
-    *output = true; // now we can say they are identical
-    if (close(lower_file) || close(upper_file)) { return -1; }
-    return 0;
+        free(buffer); // truncated: the link changed or st_size lied (e.g. procfs)
+        size *= 2;
+    }
 }
 
-int symbolic_link_identical(const char *lower_path, const char *upper_path, bool *output) {
-    char lower_buffer[PATH_MAX];
-    char upper_buffer[PATH_MAX];
-    ssize_t lower_len = readlink(lower_path, lower_buffer, PATH_MAX);
-    ssize_t upper_len = readlink(upper_path, upper_buffer, PATH_MAX);
-    if (lower_len < 0 || lower_len == PATH_MAX) {
-        fprintf(stderr, "Symbolic link %s cannot be resolved.\n", lower_path);
+int symbolic_link_identical(struct traverse_entry *e, bool *output) {
+    const struct stat *lower_status = entry_lower_status(e);
+    if (lower_status == NULL) { return -1; }
+    const struct stat *upper_status = entry_upper_status(e);
+    if (upper_status == NULL) { return -1; }
+    if (lower_status->st_size > 0 && upper_status->st_size > 0 && lower_status->st_size != upper_status->st_size) { // st_size of a symbolic link is the length of its target
+        *output = false;
+        return 0;
+    }
+    char *lower_buffer = read_link(e->lower_dirfd, e->lower_name, lower_status->st_size);
+    if (lower_buffer == NULL) {
+        fprintf(stderr, "Symbolic link %s cannot be resolved.\n", e->lower_path);
         return -1;
     }
-    if (upper_len < 0 || upper_len == PATH_MAX) {
-        fprintf(stderr, "Symbolic link %s cannot be resolved.\n", upper_path);
+    char *upper_buffer = read_link(e->upper_dirfd, e->upper_name, upper_status->st_size);
+    if (upper_buffer == NULL) {
+        fprintf(stderr, "Symbolic link %s cannot be resolved.\n", e->upper_path);
+        free(lower_buffer);
         return -1;
     }
-    lower_buffer[lower_len] = '\0';
-    upper_buffer[upper_len] = '\0';
     *output = (strcmp(lower_buffer, upper_buffer) == 0);
+    free(lower_buffer);
+    free(upper_buffer);
     return 0;
 }
 
-static int vacuum_d(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int vacuum_d(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool opaque;
-    if (is_opaquedir(upper_path, &opaque) < 0) { return -1; }
+    if (is_opaquedir(e, &opaque) < 0) { return -1; }
     if (opaque) { // TODO: sometimes removing opaque directory (and combine with lower directory) might be better
-        *fts_instr = FTS_SKIP;
+        *fts_instr = TRAVERSE_SKIP;
     }
     return 0;
 }
 
-static int vacuum_dp(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    if (lower_status == NULL) { return 0; } // lower does not exist
-    if (file_type(lower_status) != S_IFDIR) { return 0; }
-    if (!permission_identical(lower_status, upper_status)) { return 0; }
+static int vacuum_dp(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    if (e->lower_type == 0) { return 0; } // lower does not exist
+    if (e->lower_type != S_IFDIR) { return 0; }
+    bool same_permission;
+    if (entry_permission_identical(e, &same_permission) < 0) { return -1; }
+    if (!same_permission) { return 0; }
     bool opaque;
-    if (is_opaquedir(upper_path, &opaque) < 0) {
+    if (is_opaquedir(e, &opaque) < 0) {
         return -1;
     }
     if (opaque) { return 0; }
     // this directory might be empty if all children are deleted in previous commands. but we simply don't test whether it's that case
-    return command(script_stream, "rmdir --ignore-fail-on-non-empty %U", upper_path);
+    return command(script_stream, "rmdir --ignore-fail-on-non-empty %U", e->upper_path);
 }
 
-static int vacuum_f(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    if (lower_status == NULL) { return 0; } // lower does not exist
-    if (file_type(lower_status) != S_IFREG) { return 0; }
-    if (!permission_identical(lower_status, upper_status)) { return 0; }
+static int vacuum_f(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    if (e->lower_type == 0) { return 0; } // lower does not exist
+    if (e->lower_type != S_IFREG) { return 0; }
+    bool same_permission;
+    if (entry_permission_identical(e, &same_permission) < 0) { return -1; }
+    if (!same_permission) { return 0; }
     bool identical;
-    if (regular_file_identical(lower_path, lower_status, upper_path, upper_status, &identical) < 0) {
+    if (regular_file_identical(e, &identical) < 0) {
         return -1;
     }
     if (!identical) { return 0; }
-    return command(script_stream, "rm %U", upper_path);
+    return command(script_stream, "rm %U", e->upper_path);
 }
 
-static int vacuum_sl(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    if (lower_status == NULL) { return 0; } // lower does not exist
-    if (file_type(lower_status) != S_IFLNK) { return 0; }
-    if (!permission_identical(lower_status, upper_status)) { return 0; }
+static int vacuum_sl(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    if (e->lower_type == 0) { return 0; } // lower does not exist
+    if (e->lower_type != S_IFLNK) { return 0; }
+    bool same_permission;
+    if (entry_permission_identical(e, &same_permission) < 0) { return -1; }
+    if (!same_permission) { return 0; }
     bool identical;
-    if (symbolic_link_identical(lower_path, upper_path, &identical) < 0) {
+    if (symbolic_link_identical(e, &identical) < 0) {
         return -1;
     }
     if (!identical) { return 0; }
-    return command(script_stream, "rm %U", upper_path);
+    return command(script_stream, "rm %U", e->upper_path);
 }
 
-void print_only_in(const char *path) {
+void print_only_in(FILE *out, const char *path) {
     char *dirc = strdup(path);
     char *basec = strdup(path);
     char *dname = dirname(dirc);
     char *bname = basename(basec);
-    printf("Only in %s: %s\n", dname, bname);
+    fprintf(out, "Only in %s: %s\n", dname, bname);
     free(dirc);
     free(basec);
 }
 
-void print_removed(const char *lower_path, const size_t lower_root_len, mode_t lower_type) {
+void print_removed(FILE *out, const char *lower_path, const size_t lower_root_len, mode_t lower_type) {
     if (brief) {
-	print_only_in(lower_path);
+	print_only_in(out, lower_path);
     } else {
-        printf("Removed: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(lower_type));
+        fprintf(out, "Removed: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(lower_type));
     }
 }
 
-void print_added(const char *lower_path, const size_t lower_root_len, const char *upper_path, mode_t upper_type) {
+void print_added(FILE *out, const char *lower_path, const size_t lower_root_len, const char *upper_path, mode_t upper_type) {
     if (brief) {
-	print_only_in(upper_path);
+	print_only_in(out, upper_path);
     } else {
-        printf("Added: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(upper_type));
+        fprintf(out, "Added: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(upper_type));
     }
 }
 
-void print_replaced(const char *lower_path, const size_t lower_root_len, mode_t lower_type, const char *upper_path, mode_t upper_type) {
+void print_replaced(FILE *out, const char *lower_path, const size_t lower_root_len, mode_t lower_type, const char *upper_path, mode_t upper_type) {
     if (brief) {
-	printf("File %s is a %s while file %s is a %s\n", lower_path, ftype_name(lower_type), upper_path, ftype_name(upper_type));
+	fprintf(out, "File %s is a %s while file %s is a %s\n", lower_path, ftype_name(lower_type), upper_path, ftype_name(upper_type));
     } else {
         if (lower_type != S_IFDIR) { // dir removed already printed by list_deleted_files()
-            print_removed(lower_path, lower_root_len, lower_type);
+            print_removed(out, lower_path, lower_root_len, lower_type);
         }
-        print_added(lower_path, lower_root_len, upper_path, upper_type);
+        print_added(out, lower_path, lower_root_len, upper_path, upper_type);
     }
 }
 
-void print_modified(const char *lower_path, const size_t lower_root_len, mode_t lower_type, const char *upper_path, bool identical) {
+void print_modified(FILE *out, const char *lower_path, const size_t lower_root_len, mode_t lower_type, const char *upper_path, bool identical) {
     if (brief) {
         if (!identical) { // brief format does not print permission difference
-	    printf("%s %s and %s differ\n", ftype_name_plural(lower_type), lower_path, upper_path);
+	    fprintf(out, "%s %s and %s differ\n", ftype_name_plural(lower_type), lower_path, upper_path);
         }
     } else {
-        printf("Modified: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(lower_type));
+        fprintf(out, "Modified: %s%s\n", &lower_path[lower_root_len], TRAILING_SLASH(lower_type));
     }
 }
 
-int list_deleted_files(const char *lower_path, size_t lower_root_len, mode_t upper_type) { // This WORKS with files and itself is listed. However, prefixs are WRONG!
-    // brief format needs to print only first level deleted children under opaque dir
-    bool children = (brief && (upper_type == S_IFDIR));
-    if (!verbose && !children) {
-        if (!brief || upper_type == S_IFCHR) { // dir replaced already printed by print_replaced()
-            print_removed(lower_path, lower_root_len, S_IFDIR);
-        }
-        return 0;
+// a path growing and shrinking with the depth of the traversal. no PATH_MAX limit
+struct path_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static int path_init(struct path_buf *p, const char *root) {
+    p->len = strlen(root);
+    p->size = p->len + 256;
+    p->buf = malloc(p->size);
+    if (p->buf == NULL) { return -1; }
+    memcpy(p->buf, root, p->len + 1);
+    return 0;
+}
+
+// appends "/name". returns the previous length, for path_pop()
+static ssize_t path_push(struct path_buf *p, const char *name) {
+    size_t old_len = p->len;
+    size_t name_len = strlen(name);
+    if (p->len + name_len + 2 > p->size) {
+        size_t size = (p->len + name_len + 2) * 2;
+        char *buf = realloc(p->buf, size);
+        if (buf == NULL) { return -1; }
+        p->buf = buf;
+        p->size = size;
+    }
+    p->buf[p->len++] = '/';
+    memcpy(&p->buf[p->len], name, name_len + 1);
+    p->len += name_len;
+    return old_len;
+}
+
+static void path_pop(struct path_buf *p, size_t len) {
+    p->len = len;
+    p->buf[len] = '\0';
+}
+
+// lists the lower directory fd (closed here) and everything below it, path is its path
+static int list_deleted_dir(FILE *out, int fd, struct path_buf *path, size_t lower_root_len, bool children) {
+    struct dir_stream dir;
+    if (dir_open(&dir, fd) < 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", path->buf);
+        return -1;
     }
-    FTSENT *cur;
-    char *paths[2] = {(char *) lower_path, NULL };
-    FTS *ftsp = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
-    if (ftsp == NULL) { return -1; }
     int return_val = 0;
-    while (((cur = fts_read(ftsp)) != NULL) && (return_val == 0)) {
-        switch (cur->fts_info) {
-            case FTS_D:
-                // brief format does not need to print deleted grand children under opaque dir
-                if (children && cur->fts_level > 0) {
-                    print_removed(cur->fts_path, lower_root_len, S_IFDIR);
-                    fts_set(ftsp, cur, FTS_SKIP);
-                }
-                break; // do nothing
-            case FTS_DP:
-                // brief format does not need to print deleted dir under opaque dir itself
-                if (!children) {
-                    print_removed(cur->fts_path, lower_root_len, S_IFDIR);
+    struct dir_entry entry;
+    int read_ret;
+    while (return_val == 0 && (read_ret = dir_read(&dir, &entry)) > 0) {
+        size_t len = path->len;
+        if (path_push(path, entry.name) < 0) {
+            fprintf(stderr, "Out of memory.\n");
+            return_val = -1;
+            break;
+        }
+        mode_t type = dir_type_mode(entry.type);
+        struct stat status;
+        if (type == 0) {
+            if (fstatat(dir.fd, entry.name, &status, AT_SYMLINK_NOFOLLOW) != 0) {
+                fprintf(stderr, "Error occured when opening %s.\n", path->buf);
+                return_val = -1;
+                goto next;
+            }
+            type = file_type(&status);
+        }
+        switch (type) {
+            case S_IFDIR:
+                if (children) { // brief format does not need to print deleted grand children under opaque dir
+                    print_removed(out, path->buf, lower_root_len, S_IFDIR);
+                } else {
+                    int child_fd = openat(dir.fd, entry.name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    if (child_fd < 0) {
+                        fprintf(stderr, "Error occured when opening %s.\n", path->buf);
+                        return_val = -1;
+                    } else {
+                        return_val = list_deleted_dir(out, child_fd, path, lower_root_len, false);
+                    }
                 }
                 break;
-            case FTS_F:
-                print_removed(cur->fts_path, lower_root_len, S_IFREG);
-                break;
-            case FTS_SL:
-                print_removed(cur->fts_path, lower_root_len, S_IFLNK);
+            case S_IFREG:
+                print_removed(out, path->buf, lower_root_len, S_IFREG);
                 break;
-            case FTS_DEFAULT:
-                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", cur->fts_path);
-                return_val = -1;
+            case S_IFLNK:
+                print_removed(out, path->buf, lower_root_len, S_IFLNK);
                 break;
             default:
-                fprintf(stderr, "Error occured when opening %s.\n", cur->fts_path);
+                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", path->buf);
                 return_val = -1;
         }
+next:
+        path_pop(path, len);
+    }
+    if (return_val == 0 && read_ret < 0) {
+        fprintf(stderr, "Error occured when reading %s.\n", path->buf);
+        return_val = -1;
+    }
+    dir_close(&dir);
+    // brief format does not need to print deleted dir under opaque dir itself
+    if (return_val == 0 && !children) {
+        print_removed(out, path->buf, lower_root_len, S_IFDIR);
     }
-    if (errno) { return_val = -1; } // if no error happened, fts_read will "sets the external variable errno to 0" according to the documentation
-    return fts_close(ftsp) || return_val;
+    return return_val;
 }
 
-static int diff_d(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+int list_deleted_files(FILE *out, struct traverse_entry *e, mode_t upper_type) { // This WORKS with files and itself is listed. However, prefixs are WRONG!
+    // brief format needs to print only first level deleted children under opaque dir
+    bool children = (brief && (upper_type == S_IFDIR));
+    if (!verbose && !children) {
+        if (!brief || upper_type == S_IFCHR) { // dir replaced already printed by print_replaced()
+            print_removed(out, e->lower_path, e->lower_root_len, S_IFDIR);
+        }
+        return 0;
+    }
+    int fd = openat(e->lower_dirfd, e->lower_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", e->lower_path);
+        return -1;
+    }
+    struct path_buf path;
+    if (path_init(&path, e->lower_path) < 0) {
+        close(fd);
+        return -1;
+    }
+    int return_val = list_deleted_dir(out, fd, &path, e->lower_root_len, children);
+    free(path.buf);
+    return return_val;
+}
+
+static int diff_d(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool opaque = false;
-    bool lower_exist = (lower_status != NULL);
+    bool lower_exist = (e->lower_type != 0);
     if (lower_exist) {
-        if (file_type(lower_status) == S_IFDIR) {
-            if (is_opaquedir(upper_path, &opaque) < 0) { return -1; }
+        if (e->lower_type == S_IFDIR) {
+            if (is_opaquedir(e, &opaque) < 0) { return -1; }
             if (opaque) {
-                if (list_deleted_files(lower_path, lower_root_len, S_IFDIR) < 0) { return -1; }
+                if (list_deleted_files(script_stream, e, S_IFDIR) < 0) { return -1; }
             } else {
-                if (!permission_identical(lower_status, upper_status)) {
-                    print_modified(lower_path, lower_root_len, S_IFDIR, upper_path, true);
+                bool same_permission;
+                if (entry_permission_identical(e, &same_permission) < 0) { return -1; }
+                if (!same_permission) {
+                    print_modified(script_stream, e->lower_path, e->lower_root_len, S_IFDIR, e->upper_path, true);
                 }
                 return 0; // children must be recursed, and directory itself does not need to be printed
             }
         } else { // other types of files
-            print_replaced(lower_path, lower_root_len, file_type(lower_status), upper_path, S_IFDIR);
+            print_replaced(script_stream, e->lower_path, e->lower_root_len, e->lower_type, e->upper_path, S_IFDIR);
         }
     }
     if (!(verbose || (brief && opaque))) { // brief format needs to print children of opaque dir
-        *fts_instr = FTS_SKIP;
+        *fts_instr = TRAVERSE_SKIP;
     }
     if (!lower_exist || (!brief && opaque)) { // brief format does not need to print opaque dir itself
-        print_added(lower_path, lower_root_len, upper_path, S_IFDIR);
+        print_added(script_stream, e->lower_path, e->lower_root_len, e->upper_path, S_IFDIR);
     }
     return 0;
 }
 
-static int diff_f(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int diff_f(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool identical;
-    if (lower_status != NULL) {
-        switch (file_type(lower_status)) {
+    if (e->lower_type != 0) {
+        switch (e->lower_type) {
             case S_IFREG:
-                if (regular_file_identical(lower_path, lower_status, upper_path, upper_status, &identical) < 0) {
+                if (regular_file_identical(e, &identical) < 0) {
                     return -1;
                 }
-                if (!(identical && permission_identical(lower_status, upper_status))) {
-                    print_modified(lower_path, lower_root_len, S_IFREG, upper_path, identical);
+                bool same_permission = false;
+                if (identical && entry_permission_identical(e, &same_permission) < 0) { return -1; }
+                if (!(identical && same_permission)) {
+                    print_modified(script_stream, e->lower_path, e->lower_root_len, S_IFREG, e->upper_path, identical);
                 }
                 return 0;
             case S_IFDIR:
-                if (list_deleted_files(lower_path, lower_root_len, S_IFREG) < 0) { return -1; }
+                if (list_deleted_files(script_stream, e, S_IFREG) < 0) { return -1; }
                 /* fallthrough */
             case S_IFLNK:
-                print_replaced(lower_path, lower_root_len, file_type(lower_status), upper_path, S_IFREG);
+                print_replaced(script_stream, e->lower_path, e->lower_root_len, e->lower_type, e->upper_path, S_IFREG);
                 return 0;
             default:
-                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", lower_path);
+                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", e->lower_path);
                 return -1;
         }
     }
-    print_added(lower_path, lower_root_len, upper_path, S_IFREG);
+    print_added(script_stream, e->lower_path, e->lower_root_len, e->upper_path, S_IFREG);
     return 0;
 }
 
-static int diff_sl(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int diff_sl(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool identical;
-    if (lower_status != NULL) {
-        switch (file_type(lower_status)) {
+    if (e->lower_type != 0) {
+        switch (e->lower_type) {
             case S_IFDIR:
-                if (list_deleted_files(lower_path, lower_root_len, S_IFLNK) < 0) { return -1; }
+                if (list_deleted_files(script_stream, e, S_IFLNK) < 0) { return -1; }
                 /* fallthrough */
             case S_IFREG:
-                print_replaced(lower_path, lower_root_len, file_type(lower_status), upper_path, S_IFLNK);
+                print_replaced(script_stream, e->lower_path, e->lower_root_len, e->lower_type, e->upper_path, S_IFLNK);
                 return 0;
             case S_IFLNK:
-                if (symbolic_link_identical(lower_path, upper_path, &identical) < 0) {
+                if (symbolic_link_identical(e, &identical) < 0) {
                     return -1;
                 }
-                if (!(identical && permission_identical(lower_status, upper_status))) {
-                    print_modified(lower_path, lower_root_len, S_IFLNK, upper_path, identical);
+                bool same_permission = false;
+                if (identical && entry_permission_identical(e, &same_permission) < 0) { return -1; }
+                if (!(identical && same_permission)) {
+                    print_modified(script_stream, e->lower_path, e->lower_root_len, S_IFLNK, e->upper_path, identical);
                 }
                 return 0;
             default:
-                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", lower_path);
+                fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", e->lower_path);
                 return -1;
         }
     }
-    print_added(lower_path, lower_root_len, upper_path, S_IFLNK);
+    print_added(script_stream, e->lower_path, e->lower_root_len, e->upper_path, S_IFLNK);
     return 0;
 }
 
-static int diff_whiteout(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    if (lower_status != NULL) {
-        if (file_type(lower_status) == S_IFDIR) {
-            if (list_deleted_files(lower_path, lower_root_len, S_IFCHR) < 0) { return -1; }
+static int diff_whiteout(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    if (e->lower_type != 0) {
+        if (e->lower_type == S_IFDIR) {
+            if (list_deleted_files(script_stream, e, S_IFCHR) < 0) { return -1; }
         } else {
-            print_removed(lower_path, lower_root_len, file_type(lower_status));
+            print_removed(script_stream, e->lower_path, e->lower_root_len, e->lower_type);
         }
     } // else: whiteouting a nonexistent file? must be an error. but we ignore that :)
     return 0;
 }
 
-static int merge_d(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int merge_d(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool redirect;
-    if (is_redirect(upper_path, &redirect) < 0) { return -1; }
+    if (is_redirect(e, &redirect) < 0) { return -1; }
     // merging redirects is not supported, we must abort merge so redirected lower (under whiteout) won't be deleted
-    // upper_path may be hiding the directory in lower_path, but there may be another redirect upper pointing at it
+    // e->upper_path may be hiding the directory in e->lower_path, but there may be another redirect upper pointing at it
     if (redirect) {
-        fprintf(stderr, "Found redirect on %s. Merging redirect is not supported - Abort.\n", upper_path);
+        fprintf(stderr, "Found redirect on %s. Merging redirect is not supported - Abort.\n", e->upper_path);
         return -1;
     }
-    if (lower_status != NULL) {
-        if (file_type(lower_status) == S_IFDIR) {
+    if (e->lower_type != 0) {
+        if (e->lower_type == S_IFDIR) {
             bool opaque = false;
-            if (is_opaquedir(upper_path, &opaque) < 0) { return -1; }
+            if (is_opaquedir(e, &opaque) < 0) { return -1; }
             if (opaque) {
-                if (command(script_stream, "rm -r %L", lower_path) < 0) { return -1; };
+                if (command(script_stream, "rm -r %L", e->lower_path) < 0) { return -1; };
             } else {
-                if (!permission_identical(lower_status, upper_status)) {
-                    command(script_stream, "chmod --reference %U %L", upper_path, lower_path);
+                bool same_permission;
+                if (entry_permission_identical(e, &same_permission) < 0) { return -1; }
+                if (!same_permission) {
+                    command(script_stream, "chmod --reference %U %L", e->upper_path, e->lower_path);
                 }
                 return 0; // children must be recursed, and directory itself does not need to be printed
             }
         } else {
-            command(script_stream, "rm %L", lower_path);
+            command(script_stream, "rm %L", e->lower_path);
         }
     }
-    *fts_instr = FTS_SKIP;
-    return command(script_stream, "mv -T %U %L", upper_path, lower_path);
+    *fts_instr = TRAVERSE_SKIP;
+    return command(script_stream, "mv -T %U %L", e->upper_path, e->lower_path);
 }
 
-static int merge_dp(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    if (lower_status != NULL) {
-        if (file_type(lower_status) == S_IFDIR) {
+static int merge_dp(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    if (e->lower_type != 0) {
+        if (e->lower_type == S_IFDIR) {
             bool opaque = false;
-            if (is_opaquedir(upper_path, &opaque) < 0) { return -1; }
-            if (strlen(lower_path) == lower_root_len)
+            if (is_opaquedir(e, &opaque) < 0) { return -1; }
+            if (strlen(e->lower_path) == e->lower_root_len)
             {
               // Finish, don't delete upper_path_root
             }
             else if (!opaque) { // delete the directory: it should be empty already
-                return command(script_stream, "rmdir %U", upper_path);
+                return command(script_stream, "rmdir %U", e->upper_path);
             }
         }
     }
     return 0;
 }
 
-static int merge_f(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int merge_f(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool metacopy, redirect;
-    if (is_metacopy(upper_path, &metacopy) < 0) { return -1; }
-    if (is_redirect(upper_path, &redirect) < 0) { return -1; }
+    if (is_metacopy(e, &metacopy) < 0) { return -1; }
+    if (is_redirect(e, &redirect) < 0) { return -1; }
     // merging red is not supported, we must abort merge so lower data won't be deleted
     if (redirect) {
-        fprintf(stderr, "Found redirect on %s. Merging redirect is not supported - Abort.\n", upper_path);
+        fprintf(stderr, "Found redirect on %s. Merging redirect is not supported - Abort.\n", e->upper_path);
         return -1;
     }
     if (metacopy) {
-        return command(script_stream, "cp --attributes-only --preserve=all %U %L", upper_path, lower_path) || command(script_stream, "rm %U", upper_path);
+        return command(script_stream, "cp --attributes-only --preserve=all %U %L", e->upper_path, e->lower_path) || command(script_stream, "rm %U", e->upper_path);
+    }
+    // keep hard links: the other names of a file are linked to the one merged first. that name must come first in
+    // the script too, which only the serial traversal guarantees. in parallel, the other names are merged as they are
+    // and linked again at the end of the script (see relink())
+    if (e->inodes != NULL) {
+        const struct stat *upper_status = entry_upper_status(e);
+        if (upper_status == NULL) { return -1; }
+        const char *merged = (upper_status->st_nlink > 1) ? inode_map_merged(e->inodes, upper_status, e->lower_path) : NULL;
+        if (merged != NULL && jobs == 1) {
+            return command(script_stream, "rm -rf %L", e->lower_path) || command(script_stream, "ln -T %L %L", merged, e->lower_path) || command(script_stream, "rm %U", e->upper_path);
+        }
+        if (merged != NULL && inode_map_add_link(e->inodes, merged, e->lower_path) < 0) { return -1; }
+    }
+    return command(script_stream, "rm -rf %L", e->lower_path) || command(script_stream, "mv -T %U %L", e->upper_path, e->lower_path);
+}
+
+static int merge_sl(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    return command(script_stream, "rm -rf %L", e->lower_path) || command(script_stream, "mv -T %U %L", e->upper_path, e->lower_path);
+}
+
+static int merge_whiteout(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
+    return command(script_stream, "rm -r %L", e->lower_path) || command(script_stream, "rm %U", e->upper_path);
+}
+
+typedef int (*TRAVERSE_CALLBACK)(struct traverse_entry *e, FILE* script_stream, int *fts_instr);
+
+enum { COMPARE_NONE, COMPARE_ALL, COMPARE_SAME_PERMISSION };
+
+struct walk_task;
+
+struct traverse_ctx {
+    size_t lower_root_len;
+    TRAVERSE_CALLBACK callback_d, callback_dp, callback_f, callback_sl, callback_whiteout;
+    bool io_uring; // use_io_uring, and a ring could be set up
+    bool merge_join;
+    bool inode_order;
+    int compare; // COMPARE_*, which regular files the callbacks compare the contents of
+    size_t dir_limit; // memory for the directory being read by each walker, 0 for no limit
+    struct inode_map *inodes;
+    struct compare_pool *compare_pool;
+    struct manifest *manifest;
+    bool checkpoint; // checkpoint_path is set, serial traversal only
+    // below: parallel traversal only
+    struct pool *pool;
+    pthread_key_t ring_key; // each worker thread has its own ring
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when a task is done, has output, or output has been written
+    bool failed;
+    int *fail_pos; // earliest failed position seen so far, in serial order
+    size_t fail_depth;
+    size_t output_limit; // buffered output above which workers wait for the writer, 0 for no limit
+    size_t buffered; // output cut into chunks but not written yet
+    struct walk_task *emitting; // task whose output is being written
+};
+
+// state of one thread walking the tree
+struct walker {
+    struct traverse_ctx *ctx;
+    struct path_buf lower;
+    struct path_buf upper;
+    FILE *out; // serial traversal only, the parallel one writes to task->out
+    struct walk_task *task; // NULL in the serial traversal
+    int index; // parallel traversal only: entry of the task directory being visited (-1 before the first, INT_MAX for FTS_DP)
+    struct uring *ring; // NULL without the io_uring backend
+    // below: checkpoints only
+    struct walk_level *levels; // one per directory being read, from the top
+    size_t depth;
+    size_t levels_size;
+    const struct checkpoint *resume; // the cursor to skip to, NULL once reached
+    time_t checkpoint_time;
+};
+
+// the entry being visited in one directory
+struct walk_level {
+    int index;
+    size_t name; // offset of its name in walker.upper
+};
+
+// openat(AT_FDCWD, path, flags) for paths of any length: longer ones are opened a few components at a time
+static int open_path(const char *path, int flags) {
+    int dirfd = AT_FDCWD;
+    char *copy = NULL;
+    const char *rest = path;
+    while (strlen(rest) >= PATH_MAX) {
+        if (copy == NULL) {
+            copy = strdup(path);
+            if (copy == NULL) { return -1; }
+            rest = copy + (rest - path);
+        }
+        char *cut = (char *) rest + PATH_MAX - 1;
+        while (cut > rest && *cut != '/') { cut--; }
+        if (cut == rest) { // a single component longer than PATH_MAX
+            errno = ENAMETOOLONG;
+            break;
+        }
+        *cut = '\0';
+        int fd = openat(dirfd, rest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd != AT_FDCWD) { close(dirfd); }
+        if (fd < 0) {
+            free(copy);
+            return -1;
+        }
+        dirfd = fd;
+        rest = cut + 1;
+    }
+    int fd = (strlen(rest) >= PATH_MAX) ? -1 : openat(dirfd, rest, flags);
+    int saved_errno = errno;
+    if (dirfd != AT_FDCWD) { close(dirfd); }
+    free(copy);
+    errno = saved_errno;
+    return fd;
+}
+
+static inline FILE *walker_out(struct walker *w);
+
+// fills in the lower counterpart of e, if any
+static int lookup_lower(struct traverse_entry *e) {
+    e->lower_type = 0;
+    if (e->lower_dirfd == -1) { return 0; } // the lower parent does not exist (or is not a directory)
+    if (fstatat(e->lower_dirfd, e->lower_name, &e->lower_status, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT || errno == ENOTDIR) { // the corresponding lower file does not exist at all
+            return 0;
+        }
+        // stat failed for some unknown reason
+        fprintf(stderr, "Failed to stat %s.\n", e->lower_path);
+        return -1;
+    }
+    e->lower_stat_valid = true;
+    e->lower_type = file_type(&e->lower_status);
+    return 0;
+}
+
+static int walk_flush(struct walk_task *task);
+
+static int visit(struct walker *w, struct traverse_entry *e, TRAVERSE_CALLBACK callback, int *fts_instr) {
+    // the path buffers may have moved since the entry was set up
+    e->lower_path = w->lower.buf;
+    e->upper_path = w->upper.buf;
+    int return_val = callback(e, walker_out(w), fts_instr);
+    if (return_val == 0 && w->task != NULL) { return_val = walk_flush(w->task); }
+    return return_val;
+}
+
+static int descend(struct walker *w, struct traverse_entry *dir);
+
+/*
+ * checkpoints (--checkpoint, serial traversal only)
+ *
+ * after an entry has been visited completely (with its whole subtree), the cursor to the next entry is saved together
+ * with the size of the output so far, at most every checkpoint_interval seconds. entries are identified by their
+ * index in their directory, as the listings come in the same order again as long as the directories do not change.
+ * the names are kept to tell if they did. a resumed traversal skips everything before the cursor, and does not run
+ * the FTS_D callbacks of the directories that were in progress again.
+ */
+
+static int walk_level_push(struct walker *w) {
+    if (w->depth == w->levels_size) {
+        size_t size = (w->levels_size == 0) ? 16 : w->levels_size * 2;
+        struct walk_level *levels = realloc(w->levels, size * sizeof(struct walk_level));
+        if (levels == NULL) { return -1; }
+        w->levels = levels;
+        w->levels_size = size;
+    }
+    w->levels[w->depth].index = -1;
+    w->levels[w->depth].name = 0;
+    w->depth++;
+    return 0;
+}
+
+// called after the entry of the deepest level has been visited completely
+static int walk_checkpoint(struct walker *w) {
+    if (!checkpoint_interrupted && time(NULL) - w->checkpoint_time < (time_t) checkpoint_interval) { return 0; }
+    struct checkpoint cp = checkpoint;
+    struct stat st;
+    int return_val = -1;
+    cp.depth = w->depth;
+    cp.index = malloc(w->depth * sizeof(int));
+    cp.name = malloc(w->depth * sizeof(char *));
+    char *names = strdup(w->upper.buf);
+    if (cp.index == NULL || cp.name == NULL || names == NULL) { goto out; }
+    for (size_t i = 0; i < w->depth; i++) {
+        cp.index[i] = w->levels[i].index;
+        cp.name[i] = &names[w->levels[i].name];
+        if (i + 1 < w->depth) { names[w->levels[i + 1].name - 1] = '\0'; } // the '/' after it
+    }
+    cp.index[w->depth - 1]++;
+    if (fflush(w->out) != 0 || fsync(fileno(w->out)) != 0 || fstat(fileno(w->out), &st) != 0) { goto out; }
+    cp.offset = st.st_size;
+    if (checkpoint_write(checkpoint_path, &cp) < 0) { goto out; }
+    w->checkpoint_time = time(NULL);
+    return_val = 0;
+out:
+    if (return_val < 0) { fprintf(stderr, "Checkpoint %s cannot be written.\n", checkpoint_path); }
+    free(cp.index);
+    free(cp.name);
+    free(names);
+    if (return_val == 0 && checkpoint_interrupted) {
+        fprintf(stderr, "Interrupted. The checkpoint is saved in %s, run again with --resume to continue.\n", checkpoint_path);
+        return_val = -1;
+    }
+    return return_val;
+}
+
+static bool walk_aborted(const struct walk_task *task, int index);
+
+/*
+ * io_uring backend (--io-uring)
+ *
+ * the entries of a directory are read ahead in batches. for a whole batch, the lower and (where needed) upper
+ * statx, then the trusted.overlay.* probes the callbacks are going to ask for, are submitted at once. the entries
+ * are then visited in order as usual, finding their lookups done. whatever the backend could not answer
+ * (errors other than ENOENT/ENODATA, paths longer than PATH_MAX) is simply looked up again synchronously,
+ * so messages and results are the same as without it.
+ */
+
+#define BATCH_SIZE 64 // entries looked up together
+#define INODE_ORDER_BATCH_SIZE 256 // larger batches give the sort more to work with
+#define RING_SIZE (INODE_ORDER_BATCH_SIZE * 3) // up to 3 requests per entry and round
+// memory of one batch entry with its name and lookup buffers, to size batches under --memory-limit
+#define BATCH_ENTRY_COST (sizeof(struct batch_entry) + 64 + 2 * sizeof(struct statx) + 2 * sizeof(size_t))
+#define NOT_LOOKED_UP 1 // not a syscall result
+
+struct batch_entry {
+    size_t name; // offsets into dir_batch.names
+    size_t path; // full upper path, for the path based getxattr
+    unsigned char type;
+    ino_t ino;
+    ino_t lower_ino; // merge-join mode: from the lower listing, 0 if unknown
+    int lower_res; // lower_status looked up ahead: 0 (found), -errno, or NOT_LOOKED_UP
+    mode_t lower_type; // merge-join mode: type of the lower counterpart found in the lower listing, if known
+    struct stat lower_status;
+    int upper_res;
+    struct stat upper_status;
+    unsigned char xattr_known, xattr_set;
+    char opaque; // value of the opaque xattr
+    unsigned char content; // CONTENT_*, compared ahead in inode order mode
+};
+
+struct dir_batch {
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_size;
+    struct batch_entry entries[];
+};
+
+enum { PROBE_LOWER, PROBE_UPPER, PROBE_OPAQUE, PROBE_REDIRECT, PROBE_METACOPY, PROBE_KINDS };
+
+static struct dir_batch *batch_new(size_t capacity) {
+    struct dir_batch *batch = malloc(sizeof(struct dir_batch) + capacity * sizeof(struct batch_entry));
+    if (batch == NULL) { return NULL; }
+    batch->count = 0;
+    batch->capacity = capacity;
+    batch->names_size = capacity * 64;
+    batch->names_len = 0;
+    batch->names = malloc(batch->names_size);
+    if (batch->names == NULL) { free(batch); return NULL; }
+    return batch;
+}
+
+static void batch_free(struct dir_batch *batch) {
+    if (batch == NULL) { return; }
+    free(batch->names);
+    free(batch);
+}
+
+static int batch_reserve(struct dir_batch *batch, size_t len) {
+    if (batch->names_len + len > batch->names_size) {
+        size_t size = (batch->names_len + len) * 2;
+        char *names = realloc(batch->names, size);
+        if (names == NULL) { return -1; }
+        batch->names = names;
+        batch->names_size = size;
+    }
+    return 0;
+}
+
+// copies name into the name buffer, returns its offset or (size_t) -1
+static size_t batch_store_name(struct dir_batch *batch, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (batch_reserve(batch, len) < 0) { return (size_t) -1; }
+    size_t offset = batch->names_len;
+    memcpy(&batch->names[offset], name, len);
+    batch->names_len += len;
+    return offset;
+}
+
+// stores "dir/name" for the stored name of b, returns its offset or (size_t) -1
+static size_t batch_store_path(struct dir_batch *batch, const char *dir, const struct batch_entry *b) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(&batch->names[b->name]) + 1;
+    if (batch_reserve(batch, dir_len + 1 + name_len) < 0) { return (size_t) -1; }
+    size_t offset = batch->names_len;
+    memcpy(&batch->names[offset], dir, dir_len);
+    batch->names[offset + dir_len] = '/';
+    memcpy(&batch->names[offset + dir_len + 1], &batch->names[b->name], name_len);
+    batch->names_len += dir_len + 1 + name_len;
+    return offset;
+}
+
+// appends an entry, or returns NULL if its name cannot be stored
+static struct batch_entry *batch_add(struct dir_batch *batch, const char *name, unsigned char type, ino_t ino) {
+    struct batch_entry *b = &batch->entries[batch->count];
+    b->name = batch_store_name(batch, name);
+    if (b->name == (size_t) -1) { return NULL; }
+    b->path = (size_t) -1;
+    b->type = type;
+    b->ino = ino;
+    b->lower_ino = 0;
+    b->lower_res = b->upper_res = NOT_LOOKED_UP;
+    b->lower_type = 0;
+    b->xattr_known = b->xattr_set = 0;
+    b->content = CONTENT_UNKNOWN;
+    batch->count++;
+    return b;
+}
+
+// reads up to batch->capacity entries. returns the number read, or -1 on error (errno set)
+static int batch_fill(struct dir_stream *dir, struct dir_batch *batch) {
+    struct dir_entry entry;
+    int ret = 0;
+    batch->count = 0;
+    batch->names_len = 0;
+    while (batch->count < batch->capacity && (ret = dir_read(dir, &entry)) > 0) {
+        if (batch_add(batch, entry.name, entry.type, entry.ino) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return (ret < 0) ? -1 : (int) batch->count;
+}
+
+/*
+ * merge-join mode (--merge-join)
+ *
+ * an upper directory and its lower counterpart are both read completely and sorted by name. walking the two lists
+ * side by side tells for every upper name whether, and as what type, it exists in lowerdir: no lstat() for the
+ * (often many) names that only exist in upperdir, and lower status is only fetched when a callback needs it.
+ */
+
+struct listing_entry {
+    const char *name;
+    size_t offset; // of name in listing.names, which may move while reading
+    ino_t ino;
+    unsigned char type;
+};
+
+struct listing {
+    struct listing_entry *entries;
+    size_t count;
+    char *names;
+};
+
+static int listing_cmp(const void *a, const void *b) {
+    return strcmp(((const struct listing_entry *) a)->name, ((const struct listing_entry *) b)->name);
+}
+
+// reads the rest of dir into l, sorted by name. returns -1 on error (errno set), 1 (and no listing) if it would
+// take more than limit bytes
+static int listing_read(struct dir_stream *dir, struct listing *l, size_t limit) {
+    size_t names_len = 0, names_size = 4096, size = 64;
+    l->count = 0;
+    l->names = malloc(names_size);
+    l->entries = malloc(size * sizeof(struct listing_entry));
+    if (l->names == NULL || l->entries == NULL) { goto nomem; }
+    struct dir_entry entry;
+    int ret;
+    while ((ret = dir_read(dir, &entry)) > 0) {
+        size_t len = strlen(entry.name) + 1;
+        if (limit > 0 && names_len + len + (l->count + 1) * sizeof(struct listing_entry) > limit) {
+            ret = 1;
+            goto fail;
+        }
+        if (names_len + len > names_size) {
+            names_size = (names_len + len) * 2;
+            char *names = realloc(l->names, names_size);
+            if (names == NULL) { goto nomem; }
+            l->names = names;
+        }
+        if (l->count == size) {
+            size *= 2;
+            struct listing_entry *entries = realloc(l->entries, size * sizeof(struct listing_entry));
+            if (entries == NULL) { goto nomem; }
+            l->entries = entries;
+        }
+        memcpy(&l->names[names_len], entry.name, len);
+        l->entries[l->count].offset = names_len;
+        l->entries[l->count].ino = entry.ino;
+        l->entries[l->count].type = entry.type;
+        l->count++;
+        names_len += len;
+    }
+    if (ret < 0) { ret = -1; goto fail; }
+    for (size_t i = 0; i < l->count; i++) {
+        l->entries[i].name = &l->names[l->entries[i].offset];
+    }
+    qsort(l->entries, l->count, sizeof(struct listing_entry), listing_cmp);
+    return 0;
+nomem:
+    errno = ENOMEM;
+    ret = -1;
+fail:
+    free(l->names);
+    free(l->entries);
+    l->names = NULL;
+    l->entries = NULL;
+    l->count = 0;
+    return ret;
+}
+
+static void listing_free(struct listing *l) {
+    free(l->names);
+    free(l->entries);
+    l->names = NULL;
+    l->entries = NULL;
+    l->count = 0;
+}
+
+// like batch_fill(), taking the next names of the upper listing and joining them with the lower listing (if any)
+static int batch_fill_join(struct dir_batch *batch, const struct listing *upper, size_t *upper_pos, const struct listing *lower, size_t *lower_pos) {
+    batch->count = 0;
+    batch->names_len = 0;
+    while (batch->count < batch->capacity && *upper_pos < upper->count) {
+        const struct listing_entry *u = &upper->entries[(*upper_pos)++];
+        struct batch_entry *b = batch_add(batch, u->name, u->type, u->ino);
+        if (b == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (lower != NULL) {
+            int cmp = 1;
+            while (*lower_pos < lower->count && (cmp = strcmp(lower->entries[*lower_pos].name, u->name)) < 0) {
+                (*lower_pos)++; // only in lowerdir
+            }
+            if (*lower_pos < lower->count && cmp == 0) {
+                const struct listing_entry *l = &lower->entries[(*lower_pos)++];
+                b->lower_type = dir_type_mode(l->type); // 0: unknown, looked up as usual
+                b->lower_ino = l->ino;
+            } else {
+                b->lower_res = -ENOENT;
+            }
+        }
+    }
+    return (int) batch->count;
+}
+
+struct batch_run {
+    struct dir_batch *batch;
+    struct statx *stx; // two per entry: lower and upper
+};
+
+static void batch_complete(void *arg, uint64_t user_data, int res) {
+    struct batch_run *run = arg;
+    size_t i = user_data / PROBE_KINDS;
+    struct batch_entry *b = &run->batch->entries[i];
+    switch (user_data % PROBE_KINDS) {
+        case PROBE_LOWER:
+            b->lower_res = res;
+            if (res == 0) { statx_to_stat(&run->stx[2 * i], &b->lower_status); }
+            break;
+        case PROBE_UPPER:
+            b->upper_res = res;
+            if (res == 0) { statx_to_stat(&run->stx[2 * i + 1], &b->upper_status); }
+            break;
+        case PROBE_OPAQUE: // same conditions as is_opaque()
+            if (res >= 0 || res == -ENODATA) {
+                b->xattr_known |= XATTR_OPAQUE;
+                if (res == 1 && b->opaque == 'y') { b->xattr_set |= XATTR_OPAQUE; }
+            }
+            break;
+        case PROBE_REDIRECT:
+            if (res >= 0 || res == -ENODATA) {
+                b->xattr_known |= XATTR_REDIRECT;
+                if (res > 0) { b->xattr_set |= XATTR_REDIRECT; }
+            }
+            break;
+        case PROBE_METACOPY:
+            if (res >= 0 || res == -ENODATA) {
+                b->xattr_known |= XATTR_METACOPY;
+                if (res >= 0) { b->xattr_set |= XATTR_METACOPY; }
+            }
+            break;
+    }
+}
+
+static inline mode_t batch_upper_type(const struct batch_entry *b) {
+    return (b->upper_res == 0) ? file_type(&b->upper_status) : dir_type_mode(b->type);
+}
+
+// whether the upper entry is going to be stat()ed anyway: a possible whiteout, or something to compare with lower
+static inline bool batch_needs_upper(const struct batch_entry *b) {
+    mode_t type = dir_type_mode(b->type);
+    return type == 0 || type == S_IFCHR || b->lower_res == 0 || b->lower_type != 0;
+}
+
+#define SMALL_FILE_SIZE ((off_t) 16 << 10) // largest file read ahead in one request, see batch_compare_small()
+
+// whether entry b may be read ahead as a small file, as far as is known before its upper status
+static inline bool batch_small(const struct batch_entry *b) {
+    return b->lower_res == 0 && file_type(&b->lower_status) == S_IFREG && b->lower_status.st_size <= SMALL_FILE_SIZE;
+}
+
+// whether the overlay xattrs of entry b are looked up ahead: of directories, and of files there is a lower file to compare with
+static inline bool batch_probe_xattrs(const struct batch_entry *b) {
+    mode_t type = batch_upper_type(b);
+    return type == S_IFDIR || (type == S_IFREG && b->lower_res == 0);
+}
+
+/*
+ * the orders are NULL, or the orders in which to look up the lower and upper entries. with small, the upper status
+ * of small files is looked up too, for batch_compare_small()
+ */
+static void batch_prefetch(struct uring *ring, struct dir_batch *batch, const size_t *lower_order, const size_t *upper_order, int lower_fd, int upper_fd, const char *upper_path, bool small) {
+    const unsigned mask = STATX_BASIC_STATS;
+    const int flags = AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT;
+    struct batch_run run = { batch, malloc(batch->count * 2 * sizeof(struct statx)) };
+    if (run.stx == NULL) { return; }
+    for (size_t k = 0; lower_fd >= 0 && k < batch->count; k++) {
+        size_t i = (lower_order != NULL) ? lower_order[k] : k;
+        struct batch_entry *b = &batch->entries[i];
+        if (b->lower_res == NOT_LOOKED_UP) {
+            uring_statx(ring, lower_fd, &batch->names[b->name], flags, mask, &run.stx[2 * i], i * PROBE_KINDS + PROBE_LOWER);
+        }
+    }
+    for (size_t k = 0; k < batch->count; k++) {
+        size_t i = (upper_order != NULL) ? upper_order[k] : k;
+        const char *name = &batch->names[batch->entries[i].name];
+        mode_t type = dir_type_mode(batch->entries[i].type);
+        if (type == 0 || type == S_IFCHR) {
+            uring_statx(ring, upper_fd, name, flags, mask, &run.stx[2 * i + 1], i * PROBE_KINDS + PROBE_UPPER);
+        }
+    }
+    if (uring_run(ring, batch_complete, &run) < 0) { goto out; }
+    // storing the paths may move the name buffer: all of them first, as the ring only reads the names at uring_run()
+    for (size_t i = 0; i < batch->count; i++) {
+        struct batch_entry *b = &batch->entries[i];
+        if (batch_probe_xattrs(b)) { b->path = batch_store_path(batch, upper_path, b); }
+    }
+    for (size_t k = 0; k < batch->count; k++) {
+        size_t i = (upper_order != NULL) ? upper_order[k] : k;
+        struct batch_entry *b = &batch->entries[i];
+        if ((upper_order != NULL || (small && batch_small(b))) && b->upper_res == NOT_LOOKED_UP && batch_needs_upper(b)) {
+            uring_statx(ring, upper_fd, &batch->names[b->name], flags, mask, &run.stx[2 * i + 1], i * PROBE_KINDS + PROBE_UPPER);
+        }
+        if (b->path == (size_t) -1 || strlen(&batch->names[b->path]) >= PATH_MAX) { continue; }
+        const char *path = &batch->names[b->path];
+        bool dir = (batch_upper_type(b) == S_IFDIR);
+        if (dir) {
+            uring_getxattr(ring, path, ovl_opaque_xattr, &b->opaque, 1, i * PROBE_KINDS + PROBE_OPAQUE);
+        } else {
+            uring_getxattr(ring, path, ovl_metacopy_xattr, NULL, 0, i * PROBE_KINDS + PROBE_METACOPY);
+        }
+        uring_getxattr(ring, path, ovl_redirect_xattr, NULL, 0, i * PROBE_KINDS + PROBE_REDIRECT);
+    }
+    uring_run(ring, batch_complete, &run);
+out:
+    free(run.stx);
+}
+
+/*
+ * inode order mode (--inode-order)
+ *
+ * on cold caches, the lookups of a directory in readdir (hash) order jump all over the inode tables. here the lower
+ * and upper status of a whole batch are fetched ahead in ascending inode number order, and the regular files that
+ * are going to be compared are compared ahead too, ordered by the physical position of their lower data (FIEMAP).
+ * the lower inode numbers are only known in merge-join mode, otherwise the lower lookups follow the upper inodes.
+ * results and errors left unknown are looked up again, in order, when the entries are visited.
+ */
+
+struct order_key {
+    uint64_t key;
+    size_t index;
+};
+
+static int order_key_cmp(const void *a, const void *b) {
+    const struct order_key *x = a, *y = b;
+    if (x->key != y->key) { return (x->key < y->key) ? -1 : 1; }
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+// fills order with the entry indexes of batch sorted by lower (or upper) inode number
+static int batch_inode_order(const struct dir_batch *batch, size_t *order, bool lower) {
+    struct order_key *keys = malloc(batch->count * sizeof(struct order_key));
+    if (keys == NULL) { return -1; }
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct batch_entry *b = &batch->entries[i];
+        keys[i].key = (lower && b->lower_ino != 0) ? b->lower_ino : b->ino;
+        keys[i].index = i;
     }
-    return command(script_stream, "rm -rf %L", lower_path) || command(script_stream, "mv -T %U %L", upper_path, lower_path);
+    qsort(keys, batch->count, sizeof(struct order_key), order_key_cmp);
+    for (size_t i = 0; i < batch->count; i++) { order[i] = keys[i].index; }
+    free(keys);
+    return 0;
 }
 
-static int merge_sl(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    return command(script_stream, "rm -rf %L", lower_path) || command(script_stream, "mv -T %U %L", upper_path, lower_path);
+static void batch_stat_in_order(struct dir_batch *batch, const size_t *lower_order, const size_t *upper_order, int lower_fd, int upper_fd) {
+    if (lower_fd >= 0) {
+        for (size_t k = 0; k < batch->count; k++) {
+            struct batch_entry *b = &batch->entries[lower_order[k]];
+            if (b->lower_res != NOT_LOOKED_UP) { continue; }
+            b->lower_res = (fstatat(lower_fd, &batch->names[b->name], &b->lower_status, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+        }
+    }
+    for (size_t k = 0; k < batch->count; k++) {
+        struct batch_entry *b = &batch->entries[upper_order[k]];
+        if (b->upper_res != NOT_LOOKED_UP || !batch_needs_upper(b)) { continue; }
+        b->upper_res = (fstatat(upper_fd, &batch->names[b->name], &b->upper_status, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+    }
 }
 
-static int merge_whiteout(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
-    return command(script_stream, "rm -r %L", lower_path) || command(script_stream, "rm %U", upper_path);
+// physical position of the first extent of fd, UINT64_MAX if unknown (no FIEMAP support, empty or inline data)
+static uint64_t first_extent(int fd) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) != 0 || fm.map.fm_mapped_extents == 0) { return UINT64_MAX; }
+    if (fm.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) { return UINT64_MAX; }
+    return fm.extent.fe_physical;
 }
 
-typedef int (*TRAVERSE_CALLBACK)(const char *lower_path, const char* upper_path, const size_t lower_root_len, const struct stat *lower_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr);
+/*
+ * whether entry b is going to have its contents compared: same type and size (and same permissions). a metacopy upper
+ * file is not compared, but that is only checked here if the ring probed it already: regular_file_identical() checks
+ * it before using a verdict found ahead, with the xattr listing the entry gets anyway
+ */
+static bool batch_will_compare(const struct batch_entry *b, int compare) {
+    if (b->lower_res != 0 || b->upper_res != 0) { return false; }
+    if (file_type(&b->lower_status) != S_IFREG || file_type(&b->upper_status) != S_IFREG) { return false; }
+    if (b->lower_status.st_size != b->upper_status.st_size || b->lower_status.st_size == 0) { return false; }
+    if (compare == COMPARE_SAME_PERMISSION && !permission_identical(&b->lower_status, &b->upper_status)) { return false; }
+    return !(b->xattr_set & XATTR_METACOPY);
+}
+
+static void batch_compare_in_order(struct dir_batch *batch, int compare, struct inode_map *inodes, struct compare_pool *compare_pool, int lower_fd, int upper_fd) {
+    struct order_key *keys = malloc(batch->count * sizeof(struct order_key));
+    if (keys == NULL) { return; }
+    size_t n = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        struct batch_entry *b = &batch->entries[i];
+        const char *name = &batch->names[b->name];
+        if (b->content != CONTENT_UNKNOWN || !batch_will_compare(b, compare)) { continue; }
+        if (inodes != NULL && b->upper_status.st_nlink > 1 && b->lower_status.st_nlink > 1) {
+            int verdict = inode_map_verdict(inodes, &b->upper_status, &b->lower_status);
+            if (verdict >= 0) { // another name of the same inodes, compared already
+                b->content = verdict ? CONTENT_SAME : CONTENT_DIFFERENT;
+                continue;
+            }
+        }
+        int fd = openat(lower_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) { continue; }
+        keys[n].key = first_extent(fd);
+        keys[n].index = i;
+        n++;
+        close(fd);
+    }
+    qsort(keys, n, sizeof(struct order_key), order_key_cmp);
+    for (size_t k = 0; k < n; k++) {
+        struct batch_entry *b = &batch->entries[keys[k].index];
+        const char *name = &batch->names[b->name];
+        int lower_file = openat(lower_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int upper_file = openat(upper_fd, name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+        bool identical;
+        if (lower_file >= 0 && upper_file >= 0 && compare_cached(lower_file, upper_file, b->lower_status.st_size, compare_pool, &identical) == COMPARED) {
+            b->content = identical ? CONTENT_SAME : CONTENT_DIFFERENT;
+            if (inodes != NULL && b->upper_status.st_nlink > 1 && b->lower_status.st_nlink > 1) {
+                inode_map_set_verdict(inodes, &b->upper_status, &b->lower_status, identical);
+            }
+        }
+        if (lower_file >= 0) { close(lower_file); }
+        if (upper_file >= 0) { close(upper_file); }
+    }
+    free(keys);
+}
+
+/*
+ * small files (io_uring backend)
+ *
+ * upperdirs are mostly files of a few KiB, and comparing them one at a time costs each an open, a read and a close
+ * of both files, every read waiting for the disk in turn. the small regular files of a batch that are going to be
+ * compared are read ahead instead, each in a single request for one byte more than its size (which also tells that
+ * it ends there), all of a round in flight together. larger files are left to compare_files() when visited, which
+ * streams them. a read coming back short or failed leaves the entry to be compared as usual, with the usual messages.
+ */
+
+#define SMALL_ROUND_SIZE ((size_t) 1 << 20) // buffers of the files in flight at once
+
+struct small_read {
+    size_t index; // of the entry in the batch
+    int fd[2]; // lower, upper
+    char *buf[2];
+    int res[2];
+};
+
+static void small_complete(void *arg, uint64_t user_data, int res) {
+    struct small_read *reads = arg;
+    reads[user_data / 2].res[user_data % 2] = res;
+}
 
-int traverse(const char *lower_root, const char *upper_root, FILE* script_stream, TRAVERSE_CALLBACK callback_d, TRAVERSE_CALLBACK callback_dp, TRAVERSE_CALLBACK callback_f, TRAVERSE_CALLBACK callback_sl, TRAVERSE_CALLBACK callback_whiteout) { // returns 0 on success
-    FTSENT *cur;
-    char *paths[2] = {(char *) upper_root, NULL };
-    char lower_path[PATH_MAX];
-    strcpy(lower_path, lower_root);
-    size_t upper_root_len = strlen(upper_root);
-    size_t lower_root_len = strlen(lower_root);
-    FTS *ftsp = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
-    if (ftsp == NULL) { return -1; }
+// reads and compares the files of reads, and closes them. returns -1 if the ring failed (having finished the reads)
+static int small_round(struct uring *ring, struct small_read *reads, size_t n, struct dir_batch *batch, struct inode_map *inodes) {
+    if (n == 0) { return 0; }
+    for (size_t k = 0; k < n; k++) {
+        size_t len = (size_t) batch->entries[reads[k].index].lower_status.st_size + 1;
+        for (int f = 0; f < 2; f++) {
+            reads[k].res[f] = -EAGAIN;
+            throttle(len);
+            uring_read(ring, reads[k].fd[f], reads[k].buf[f], len, 0, 2 * k + f);
+        }
+    }
+    int return_val = uring_run(ring, small_complete, reads);
+    for (size_t k = 0; k < n; k++) {
+        close(reads[k].fd[0]);
+        close(reads[k].fd[1]);
+    }
+    if (return_val < 0) { return -1; }
+    for (size_t k = 0; k < n; k++) {
+        struct batch_entry *b = &batch->entries[reads[k].index];
+        off_t size = b->lower_status.st_size;
+        if (reads[k].res[0] != size || reads[k].res[1] != size) { continue; }
+        bool identical = (memcmp(reads[k].buf[0], reads[k].buf[1], (size_t) size) == 0);
+        b->content = identical ? CONTENT_SAME : CONTENT_DIFFERENT;
+        if (inodes != NULL && b->upper_status.st_nlink > 1 && b->lower_status.st_nlink > 1) {
+            inode_map_set_verdict(inodes, &b->upper_status, &b->lower_status, identical);
+        }
+    }
+    return 0;
+}
+
+static void batch_compare_small(struct uring *ring, struct dir_batch *batch, int compare, struct inode_map *inodes, int lower_fd, int upper_fd) {
+    struct small_read *reads = malloc(batch->count * sizeof(struct small_read));
+    char *buffer = malloc(SMALL_ROUND_SIZE);
+    if (reads == NULL || buffer == NULL) {
+        free(reads);
+        free(buffer);
+        return;
+    }
+    size_t n = 0, used = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        struct batch_entry *b = &batch->entries[i];
+        const char *name = &batch->names[b->name];
+        if (b->content != CONTENT_UNKNOWN || !batch_small(b) || !batch_will_compare(b, compare)) { continue; }
+        if (inodes != NULL && b->upper_status.st_nlink > 1 && b->lower_status.st_nlink > 1) {
+            int verdict = inode_map_verdict(inodes, &b->upper_status, &b->lower_status);
+            if (verdict >= 0) { // another name of the same inodes, compared already
+                b->content = verdict ? CONTENT_SAME : CONTENT_DIFFERENT;
+                continue;
+            }
+        }
+        size_t len = (size_t) b->lower_status.st_size + 1;
+        if (used + 2 * len > SMALL_ROUND_SIZE) {
+            if (small_round(ring, reads, n, batch, inodes) < 0) { n = 0; break; } // the rest are compared as usual
+            n = used = 0;
+        }
+        struct small_read *r = &reads[n];
+        r->fd[0] = openat(lower_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        r->fd[1] = openat(upper_fd, name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+        struct stat upper_status;
+        if (r->fd[0] < 0 || r->fd[1] < 0 || fstat(r->fd[1], &upper_status) != 0 || !S_ISREG(upper_status.st_mode)) {
+            if (r->fd[0] >= 0) { close(r->fd[0]); }
+            if (r->fd[1] >= 0) { close(r->fd[1]); }
+            continue;
+        }
+        compare_blocking(r->fd[1]);
+        r->index = i;
+        r->buf[0] = &buffer[used];
+        r->buf[1] = &buffer[used + len];
+        used += 2 * len;
+        n++;
+    }
+    small_round(ring, reads, n, batch, inodes);
+    free(buffer);
+    free(reads);
+}
+
+static struct uring *walker_ring(struct walker *w) {
+    if (!w->ctx->io_uring) { return NULL; }
+    if (w->task == NULL) { return w->ring; }
+    struct uring *ring = pthread_getspecific(w->ctx->ring_key);
+    if (ring == NULL) {
+        ring = uring_create(RING_SIZE);
+        pthread_setspecific(w->ctx->ring_key, ring);
+    }
+    return ring;
+}
+
+/*
+ * visits the children of dir, then dir itself (FTS_DP). dir->upper_fd must be the open directory, it is closed here
+ */
+static int traverse_dir(struct walker *w, struct traverse_entry *dir) {
+    struct traverse_ctx *ctx = w->ctx;
+    struct uring *ring = walker_ring(w);
+    struct dir_batch *batch = NULL;
+    struct listing upper_listing = { 0 }, lower_listing = { 0 };
+    size_t upper_pos = 0, lower_pos = 0;
     int return_val = 0;
-    while ((return_val == 0) && ((cur = fts_read(ftsp)) != NULL)) {
-        TRAVERSE_CALLBACK callback = NULL;
-        switch (cur->fts_info) {
-            case FTS_D:
-                callback = callback_d;
-                break;
-            case FTS_DP:
-                callback = callback_dp;
-                break;
-            case FTS_F:
-                callback = callback_f;
-                break;
-            case FTS_SL:
-                callback = callback_sl;
+    int lower_fd = -1;
+    size_t *lower_order = NULL, *upper_order = NULL; // inode order mode only
+    w->index = -1;
+    struct dir_stream upper_dir;
+    if (dir_open(&upper_dir, dir->upper_fd) < 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", w->upper.buf);
+        dir->upper_fd = -1;
+        return -1;
+    }
+    size_t level = w->depth;
+    if (ctx->checkpoint && walk_level_push(w) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        dir_close(&upper_dir);
+        dir->upper_fd = -1;
+        return -1;
+    }
+    if (dir->lower_type == S_IFDIR) {
+        lower_fd = openat(dir->lower_dirfd, dir->lower_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (lower_fd < 0) {
+            fprintf(stderr, "Failed to open %s.\n", w->lower.buf);
+            return_val = -1;
+            goto out;
+        }
+    }
+    size_t batch_size = 1;
+    if (ctx->inode_order) {
+        batch_size = INODE_ORDER_BATCH_SIZE;
+    } else if (ring != NULL || ctx->merge_join) {
+        batch_size = BATCH_SIZE;
+    }
+    // the batch and the two listings of merge-join mode get a third of the budget each
+    while (ctx->dir_limit > 0 && batch_size > 1 && batch_size * BATCH_ENTRY_COST > ctx->dir_limit / 3) { batch_size /= 2; }
+    batch = batch_new(batch_size);
+    if (batch != NULL && ctx->inode_order) {
+        lower_order = malloc(2 * batch_size * sizeof(size_t));
+        if (lower_order != NULL) { upper_order = lower_order + batch_size; }
+    }
+    if (batch == NULL || (ctx->inode_order && lower_order == NULL)) {
+        fprintf(stderr, "Out of memory.\n");
+        return_val = -1;
+        goto out;
+    }
+    bool join = ctx->merge_join;
+    if (join) {
+        int ret = listing_read(&upper_dir, &upper_listing, ctx->dir_limit / 3);
+        if (ret < 0) {
+            fprintf(stderr, "Error occured when reading %s.\n", w->upper.buf);
+            return_val = -1;
+            goto out;
+        }
+        if (ret == 0 && lower_fd >= 0) {
+            struct dir_stream lower_dir;
+            int fd = dup(lower_fd); // lower_fd stays the parent of the lower entries
+            if (fd < 0 || dir_open(&lower_dir, fd) < 0) {
+                fprintf(stderr, "Failed to open %s.\n", w->lower.buf);
+                return_val = -1;
+                goto out;
+            }
+            ret = listing_read(&lower_dir, &lower_listing, ctx->dir_limit / 3);
+            dir_close(&lower_dir);
+            if (ret < 0) {
+                fprintf(stderr, "Error occured when reading %s.\n", w->lower.buf);
+                return_val = -1;
+                goto out;
+            }
+        }
+        if (ret > 0) { // too wide to be joined within the memory limit: stream it, looking up every name instead
+            listing_free(&upper_listing);
+            listing_free(&lower_listing);
+            if (dir_rewind(&upper_dir) < 0) {
+                fprintf(stderr, "Error occured when reading %s.\n", w->upper.buf);
+                return_val = -1;
+                goto out;
+            }
+            join = false;
+        }
+    }
+    int read_ret;
+    while (return_val == 0 && (read_ret = join
+               ? batch_fill_join(batch, &upper_listing, &upper_pos, (lower_fd >= 0) ? &lower_listing : NULL, &lower_pos)
+               : batch_fill(&upper_dir, batch)) > 0) {
+        if (ctx->inode_order && (batch_inode_order(batch, lower_order, true) < 0 || batch_inode_order(batch, upper_order, false) < 0)) {
+            fprintf(stderr, "Out of memory.\n");
+            return_val = -1;
+            break;
+        }
+        // with a lower manifest, the contents of lowerdir are not read: there is nothing to read ahead or put in order
+        bool compare = (lower_fd >= 0 && ctx->compare != COMPARE_NONE && ctx->manifest == NULL);
+        // in uncached mode all reads go through uncached_pread()
+        bool small = (ring != NULL && compare && !uncached_enabled());
+        if (ring != NULL) { batch_prefetch(ring, batch, lower_order, upper_order, lower_fd, upper_dir.fd, w->upper.buf, small); }
+        if (ctx->inode_order) { batch_stat_in_order(batch, lower_order, upper_order, lower_fd, upper_dir.fd); } // what the ring left out
+        if (small) { batch_compare_small(ring, batch, ctx->compare, ctx->inodes, lower_fd, upper_dir.fd); }
+        if (ctx->inode_order && compare) { batch_compare_in_order(batch, ctx->compare, ctx->inodes, ctx->compare_pool, lower_fd, upper_dir.fd); }
+        for (size_t i = 0; return_val == 0 && i < batch->count; i++) {
+            struct batch_entry *b = &batch->entries[i];
+            const char *name = &batch->names[b->name];
+            w->index++;
+            if (w->task != NULL && walk_aborted(w->task, w->index)) {
+                return_val = -1;
                 break;
-            case FTS_DEFAULT:
-                if (is_whiteout(cur->fts_statp)) {
-                    callback = callback_whiteout;
-                } else {
+            }
+            bool resumed_dir = false; // in progress at the checkpoint, its FTS_D callback has run already
+            if (w->resume != NULL) {
+                const struct checkpoint *r = w->resume;
+                bool last = (level == r->depth - 1);
+                if (w->index < r->index[level]) {
+                    if (last && w->index == r->index[level] - 1 && strcmp(name, r->name[level]) != 0) {
+                        fprintf(stderr, "Cannot resume: %s has changed since the checkpoint.\n", w->upper.buf);
+                        return_val = -1;
+                    }
+                    continue;
+                }
+                if (!last && strcmp(name, r->name[level]) != 0) {
+                    fprintf(stderr, "Cannot resume: %s has changed since the checkpoint.\n", w->upper.buf);
                     return_val = -1;
-                    fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", cur->fts_path);
+                    break;
                 }
-                break;
-            default:
+                resumed_dir = !last;
+                if (last) { w->resume = NULL; }
+            }
+            throttle(0); // the lookups of the entry
+            size_t lower_len = w->lower.len;
+            size_t upper_len = w->upper.len;
+            if (path_push(&w->lower, name) < 0 || path_push(&w->upper, name) < 0) {
+                fprintf(stderr, "Out of memory.\n");
                 return_val = -1;
-                fprintf(stderr, "Error occured when opening %s.\n", cur->fts_path);
-        }
-        if (callback != NULL) {
+                break;
+            }
+            if (ctx->checkpoint) {
+                w->levels[level].index = w->index;
+                w->levels[level].name = upper_len + 1;
+            }
+            struct traverse_entry child = {
+                .lower_path = w->lower.buf,
+                .upper_path = w->upper.buf,
+                .lower_root_len = ctx->lower_root_len,
+                .lower_dirfd = lower_fd,
+                .lower_name = name,
+                .upper_dirfd = upper_dir.fd,
+                .upper_name = name,
+                .upper_fd = -1,
+                .upper_type = dir_type_mode(b->type),
+                .xattr_known = b->xattr_known,
+                .xattr_set = b->xattr_set,
+                .content = b->content,
+                .inodes = ctx->inodes,
+                .compare_pool = ctx->compare_pool,
+                .manifest = ctx->manifest,
+            };
+            if (b->upper_res == 0) {
+                child.upper_status = b->upper_status;
+                child.upper_stat_valid = true;
+            }
             int fts_instr = 0;
-            struct stat lower_status;
-            bool lower_exist = true;
-            strcpy(&lower_path[lower_root_len], &(cur->fts_path[upper_root_len]));
-            if (lstat(lower_path, &lower_status) != 0) {
-                if (errno == ENOENT || errno == ENOTDIR) { // the corresponding lower file (or its ancestor) does not exist at all
-                    lower_exist = false;
-                } else { // stat failed for some unknown reason
-                    fprintf(stderr, "Failed to stat %s.\n", lower_path);
+            // only a possible whiteout, or a file system not telling the type, needs a stat() here
+            if ((child.upper_type == 0 || child.upper_type == S_IFCHR) && entry_upper_status(&child) == NULL) {
+                return_val = -1;
+            } else if (b->lower_res == 0) {
+                child.lower_status = b->lower_status;
+                child.lower_stat_valid = true;
+                child.lower_type = file_type(&child.lower_status);
+            } else if (b->lower_res == -ENOENT || b->lower_res == -ENOTDIR) {
+                // does not exist
+            } else if (b->lower_type != 0) {
+                child.lower_type = b->lower_type; // from the merge-join, the status is fetched when needed
+            } else if (lookup_lower(&child) < 0) {
+                return_val = -1;
+            }
+            if (return_val == 0) {
+                if (child.upper_stat_valid) { child.upper_type = file_type(&child.upper_status); }
+                if (resumed_dir && child.upper_type != S_IFDIR) {
+                    fprintf(stderr, "Cannot resume: %s has changed since the checkpoint.\n", w->upper.buf);
                     return_val = -1;
-                    break; // do not call callback in this case
                 }
             }
-            return_val = callback(lower_path, cur->fts_path, lower_root_len, lower_exist ? &lower_status : NULL, cur->fts_statp, script_stream, &fts_instr); // return_val must previously be 0
-            if (fts_instr) {
-                fts_set(ftsp, cur, fts_instr);
+            if (return_val == 0) {
+                switch (child.upper_type) {
+                    case S_IFDIR:
+                        if (ctx->callback_d != NULL && !resumed_dir) {
+                            return_val = visit(w, &child, ctx->callback_d, &fts_instr);
+                        }
+                        if (return_val == 0) {
+                            if (fts_instr == TRAVERSE_SKIP) { // fts reports a skipped directory as FTS_DP right away
+                                if (ctx->callback_dp != NULL) {
+                                    return_val = visit(w, &child, ctx->callback_dp, &fts_instr);
+                                }
+                            } else {
+                                return_val = descend(w, &child);
+                            }
+                        }
+                        break;
+                    case S_IFREG:
+                        if (ctx->callback_f != NULL) {
+                            return_val = visit(w, &child, ctx->callback_f, &fts_instr);
+                        }
+                        break;
+                    case S_IFLNK:
+                        if (ctx->callback_sl != NULL) {
+                            return_val = visit(w, &child, ctx->callback_sl, &fts_instr);
+                        }
+                        break;
+                    default:
+                        if (child.upper_type == S_IFCHR && is_whiteout(&child.upper_status)) {
+                            if (ctx->callback_whiteout != NULL) {
+                                return_val = visit(w, &child, ctx->callback_whiteout, &fts_instr);
+                            }
+                        } else {
+                            fprintf(stderr, "File %s is a special file (device or pipe). We cannot handle that.\n", w->upper.buf);
+                            return_val = -1;
+                        }
+                }
+            }
+            if (return_val == 0 && ctx->checkpoint) { return_val = walk_checkpoint(w); }
+            if (child.upper_fd >= 0) { close(child.upper_fd); }
+            path_pop(&w->lower, lower_len);
+            path_pop(&w->upper, upper_len);
+        }
+    }
+    if (return_val == 0 && read_ret < 0) {
+        fprintf(stderr, "Error occured when reading %s.\n", w->upper.buf);
+        return_val = -1;
+    }
+    if (return_val == 0 && w->resume != NULL) {
+        if (level == w->resume->depth - 1 && w->index == w->resume->index[level] - 1) { // the last entry was the last one completed
+            w->resume = NULL;
+        } else { // the cursor is beyond the end of the directory
+            fprintf(stderr, "Cannot resume: %s has changed since the checkpoint.\n", w->upper.buf);
+            return_val = -1;
+        }
+    }
+    if (return_val == 0 && ctx->callback_dp != NULL) {
+        int fts_instr = 0;
+        w->index = INT_MAX;
+        if (w->task != NULL && walk_aborted(w->task, w->index)) {
+            return_val = -1;
+        } else {
+            return_val = visit(w, dir, ctx->callback_dp, &fts_instr);
+        }
+    }
+out:
+    if (ctx->checkpoint) { w->depth = level; }
+    free(lower_order);
+    listing_free(&upper_listing);
+    listing_free(&lower_listing);
+    batch_free(batch);
+    if (lower_fd >= 0) { close(lower_fd); }
+    dir_close(&upper_dir);
+    dir->upper_fd = -1;
+    return return_val;
+}
+
+/*
+ * parallel traversal (-j N)
+ *
+ * every directory that is descended into becomes a task of the work-stealing pool. a task lists its directory,
+ * runs the callbacks of its entries and, at last, the FTS_DP callback of the directory itself (the FTS_D callback
+ * is run by the parent, as it decides whether to descend at all). callback output goes into per-task memory
+ * streams, cut into chunks wherever a subdirectory task is spawned and whenever a chunk grows large. the calling
+ * thread stitches the chunks back together in the order the serial traversal would have produced, writing each as
+ * soon as it is cut, so the output of a wide directory flows while the directory is still being read.
+ *
+ * with --memory-limit, a worker that finds too much output waiting for earlier output to be written pauses, unless
+ * it produces the output being written. it only does so while that task is running, which can never wait.
+ *
+ * every task knows its position in the serial order (the indexes of the entries leading to it). after a failure,
+ * only work that the serial traversal would not have reached anymore is abandoned, so the output is the same
+ * prefix of the serial output that the serial traversal would have written before aborting.
+ *
+ * a task opens its directories by full path once, everything below is looked up relative to them.
+ */
+
+struct walk_chunk {
+    char *text; // output produced before child
+    size_t len;
+    struct walk_task *child; // subtree whose output follows text (may be NULL)
+    struct walk_chunk *next;
+};
+
+struct walk_task {
+    struct traverse_ctx *ctx;
+    int *pos; // entry indexes from the root down to this directory
+    size_t depth;
+    char *lower_path;
+    char *upper_path;
+    mode_t lower_type;
+    bool lower_stat_valid;
+    struct stat lower_status;
+    bool upper_stat_valid;
+    struct stat upper_status;
+    unsigned char xattr_known, xattr_set; // as looked up by the FTS_D callback, for the FTS_DP one
+    bool xattr_listed;
+    struct walk_chunk *head;
+    struct walk_chunk *tail;
+    FILE *out; // stream of the chunk being written
+    char *buf;
+    size_t buflen;
+    int return_val;
+    bool started;
+    bool done;
+};
+
+static inline FILE *walker_out(struct walker *w) {
+    return (w->task != NULL) ? w->task->out : w->out;
+}
+
+static struct walk_task *walk_task_new(struct traverse_ctx *ctx, const struct walk_task *parent, int index, const char *lower_path, const char *upper_path, const struct traverse_entry *e) {
+    struct walk_task *task = calloc(1, sizeof(struct walk_task));
+    if (task == NULL) { return NULL; }
+    task->ctx = ctx;
+    task->depth = (parent == NULL) ? 0 : parent->depth + 1;
+    task->pos = malloc((task->depth + 1) * sizeof(int));
+    if (parent != NULL && task->pos != NULL) {
+        memcpy(task->pos, parent->pos, parent->depth * sizeof(int));
+        task->pos[parent->depth] = index;
+    }
+    task->lower_path = strdup(lower_path);
+    task->upper_path = strdup(upper_path);
+    task->lower_type = e->lower_type;
+    task->lower_stat_valid = e->lower_stat_valid;
+    if (task->lower_stat_valid) { task->lower_status = e->lower_status; }
+    task->upper_stat_valid = e->upper_stat_valid;
+    if (task->upper_stat_valid) { task->upper_status = e->upper_status; }
+    task->xattr_known = e->xattr_known;
+    task->xattr_set = e->xattr_set;
+    task->xattr_listed = e->xattr_listed;
+    if (task->pos == NULL || task->lower_path == NULL || task->upper_path == NULL) {
+        free(task->pos);
+        free(task->lower_path);
+        free(task->upper_path);
+        free(task);
+        return NULL;
+    }
+    return task;
+}
+
+static void walk_task_free(struct walk_task *task) {
+    while (task->head != NULL) {
+        struct walk_chunk *chunk = task->head;
+        task->head = chunk->next;
+        if (chunk->child != NULL) { walk_task_free(chunk->child); }
+        free(chunk->text);
+        free(chunk);
+    }
+    free(task->pos);
+    free(task->lower_path);
+    free(task->upper_path);
+    free(task);
+}
+
+// compares the position of entry index of task with the failed position. call with ctx->lock held
+static int walk_cmp_failure(const struct walk_task *task, int index) {
+    const struct traverse_ctx *ctx = task->ctx;
+    size_t common = MIN(task->depth, ctx->fail_depth);
+    for (size_t i = 0; i < common; i++) {
+        if (task->pos[i] != ctx->fail_pos[i]) { return (task->pos[i] < ctx->fail_pos[i]) ? -1 : 1; }
+    }
+    if (task->depth >= ctx->fail_depth) { return 1; } // inside the subtree of the failed entry, or the failed entry itself
+    if (index == ctx->fail_pos[task->depth]) { return -1; } // the failure is deeper inside this entry
+    return (index < ctx->fail_pos[task->depth]) ? -1 : 1;
+}
+
+// whether the serial traversal would have stopped before reaching entry index of task
+static bool walk_aborted(const struct walk_task *task, int index) {
+    struct traverse_ctx *ctx = task->ctx;
+    pthread_mutex_lock(&ctx->lock);
+    bool aborted = ctx->failed && walk_cmp_failure(task, index) > 0;
+    pthread_mutex_unlock(&ctx->lock);
+    return aborted;
+}
+
+// records a failure at entry index of task, if it is the earliest one. call with ctx->lock held
+static void walk_set_failure(struct walk_task *task, int index) {
+    struct traverse_ctx *ctx = task->ctx;
+    if (ctx->failed && walk_cmp_failure(task, index) >= 0) { return; }
+    int *pos = malloc((task->depth + 1) * sizeof(int));
+    if (pos == NULL) { // keep the earlier failure: still correct, only stops less work
+        return;
+    }
+    memcpy(pos, task->pos, task->depth * sizeof(int));
+    pos[task->depth] = index;
+    free(ctx->fail_pos);
+    ctx->fail_pos = pos;
+    ctx->fail_depth = task->depth + 1;
+    ctx->failed = true;
+}
+
+#define WALK_CHUNK_SIZE (64 * 1024) // output buffered by a task before it is handed to the writer
+
+// closes the current output stream into a chunk followed by child (may be NULL), and opens a new stream unless
+// last. child is owned by task afterwards, even on failure
+static int walk_cut(struct walk_task *task, struct walk_task *child, bool last) {
+    struct traverse_ctx *ctx = task->ctx;
+    struct walk_chunk *chunk = calloc(1, sizeof(struct walk_chunk));
+    if (task->out == NULL || chunk == NULL || fclose(task->out) != 0) {
+        task->out = NULL;
+        free(chunk);
+        if (child != NULL) { walk_task_free(child); }
+        return -1;
+    }
+    task->out = NULL;
+    chunk->text = task->buf;
+    chunk->len = task->buflen;
+    chunk->child = child;
+    pthread_mutex_lock(&ctx->lock); // the writer takes chunks off the head meanwhile
+    if (task->tail == NULL) {
+        task->head = chunk;
+    } else {
+        task->tail->next = chunk;
+    }
+    task->tail = chunk;
+    ctx->buffered += chunk->len;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    if (!last) {
+        task->out = open_memstream(&task->buf, &task->buflen);
+        if (task->out == NULL) {
+            if (child != NULL) { // child is linked already but will never run
+                pthread_mutex_lock(&ctx->lock);
+                child->return_val = -1;
+                child->done = true;
+                pthread_cond_broadcast(&ctx->cond);
+                pthread_mutex_unlock(&ctx->lock);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// hands the output of task to the writer once it has grown large, then waits while too much output is buffered
+static int walk_flush(struct walk_task *task) {
+    struct traverse_ctx *ctx = task->ctx;
+    long len = ftell(task->out);
+    if (len >= 0 && len < WALK_CHUNK_SIZE) { return 0; }
+    if (walk_cut(task, NULL, false) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    if (ctx->output_limit == 0) { return 0; }
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->buffered > ctx->output_limit && !ctx->failed && ctx->emitting != NULL && ctx->emitting != task && ctx->emitting->started) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+static void walk_run(void *arg);
+
+static int descend(struct walker *w, struct traverse_entry *dir) {
+    if (w->task == NULL) { // serial traversal: just recurse
+        if (entry_upper_fd(dir) < 0) { return -1; }
+        int index = w->index;
+        int return_val = traverse_dir(w, dir);
+        w->index = index;
+        return return_val;
+    }
+    struct walk_task *child = walk_task_new(w->ctx, w->task, w->index, w->lower.buf, w->upper.buf, dir);
+    if (child == NULL || walk_cut(w->task, child, false) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    if (pool_submit(w->ctx->pool, walk_run, child) < 0) { walk_run(child); } // no room in the deque: walk it here
+    return 0;
+}
+
+static void walk_run(void *arg) {
+    struct walk_task *task = arg;
+    struct traverse_ctx *ctx = task->ctx;
+    struct walker w = { .ctx = ctx, .task = task, .index = -1 };
+    // the directories are opened by full path here, then addressed as "." so traverse_dir() can reopen the lower one
+    struct traverse_entry dir = {
+        .lower_path = task->lower_path,
+        .upper_path = task->upper_path,
+        .lower_root_len = ctx->lower_root_len,
+        .lower_dirfd = -1,
+        .lower_name = ".",
+        .upper_dirfd = -1,
+        .upper_name = ".",
+        .upper_fd = -1,
+        .lower_type = task->lower_type,
+        .lower_stat_valid = task->lower_stat_valid,
+        .lower_status = task->lower_status,
+        .upper_type = S_IFDIR,
+        .upper_stat_valid = task->upper_stat_valid,
+        .upper_status = task->upper_status,
+        .xattr_known = task->xattr_known,
+        .xattr_set = task->xattr_set,
+        .xattr_listed = task->xattr_listed,
+        .inodes = ctx->inodes,
+        .compare_pool = ctx->compare_pool,
+        .manifest = ctx->manifest,
+    };
+    int return_val = -1;
+    pthread_mutex_lock(&ctx->lock);
+    task->started = true;
+    pthread_mutex_unlock(&ctx->lock);
+    task->out = open_memstream(&task->buf, &task->buflen);
+    if (task->out == NULL) { goto done; }
+    if (path_init(&w.lower, task->lower_path) < 0 || path_init(&w.upper, task->upper_path) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        goto cleanup;
+    }
+    if (task->lower_type == S_IFDIR) {
+        dir.lower_dirfd = open_path(task->lower_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir.lower_dirfd < 0) {
+            fprintf(stderr, "Failed to open %s.\n", task->lower_path);
+            goto cleanup;
+        }
+    }
+    dir.upper_fd = open_path(task->upper_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir.upper_fd < 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", task->upper_path);
+        goto cleanup;
+    }
+    return_val = traverse_dir(&w, &dir);
+cleanup:
+    if (dir.lower_dirfd >= 0) { close(dir.lower_dirfd); }
+    free(w.lower.buf);
+    free(w.upper.buf);
+    if (walk_cut(task, NULL, true) < 0) { return_val = -1; }
+done:
+    pthread_mutex_lock(&ctx->lock);
+    task->return_val = return_val;
+    task->done = true;
+    if (return_val != 0) { walk_set_failure(task, w.index); }
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// writes the output of task in order as it comes, freeing what has been written. on failure, what is left stays
+// linked to task
+static int walk_emit(struct traverse_ctx *ctx, struct walk_task *task, FILE *script_stream) {
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->emitting = task;
+        pthread_cond_broadcast(&ctx->cond); // waiting workers check again whether the task being written runs
+        while (task->head == NULL && !task->done) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        struct walk_chunk *chunk = task->head; // the worker only appends behind it
+        pthread_mutex_unlock(&ctx->lock);
+        if (chunk == NULL) { break; } // done, and everything written
+        if (chunk->len > 0 && fwrite(chunk->text, 1, chunk->len, script_stream) != chunk->len) { return -1; }
+        pthread_mutex_lock(&ctx->lock);
+        ctx->buffered -= chunk->len;
+        pthread_mutex_unlock(&ctx->lock);
+        free(chunk->text);
+        chunk->text = NULL;
+        chunk->len = 0;
+        if (chunk->child != NULL) {
+            if (walk_emit(ctx, chunk->child, script_stream) < 0) { return -1; }
+            chunk->child = NULL;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        task->head = chunk->next;
+        if (task->head == NULL) { task->tail = NULL; }
+        pthread_mutex_unlock(&ctx->lock);
+        free(chunk);
+    }
+    if (task->return_val != 0) { return -1; }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->emitting = NULL; // until the parent is being written again
+    pthread_mutex_unlock(&ctx->lock);
+    free(task->pos);
+    free(task->lower_path);
+    free(task->upper_path);
+    free(task);
+    return 0;
+}
+
+static void ring_key_destroy(void *ring) {
+    uring_destroy(ring);
+}
+
+// the end of a parallel merge: every name has been merged by then, whatever order the workers found them in
+static int relink(const char *merged, const char *lower_path, void *script_stream) {
+    return command(script_stream, "rm -rf %L", lower_path) || command(script_stream, "ln -T %L %L", merged, lower_path);
+}
+
+static int traverse_parallel(struct traverse_ctx *ctx, struct traverse_entry *root, FILE* script_stream) {
+    struct walk_task *task = walk_task_new(ctx, NULL, 0, root->lower_path, root->upper_path, root);
+    if (task == NULL) { return -1; }
+    ctx->pool = pool_create(jobs);
+    if (ctx->pool == NULL) {
+        fprintf(stderr, "Worker threads cannot be started.\n");
+        walk_task_free(task);
+        return -1;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    if (ctx->io_uring && pthread_key_create(&ctx->ring_key, ring_key_destroy) != 0) { ctx->io_uring = false; }
+    int return_val = -1;
+    if (pool_submit(ctx->pool, walk_run, task) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+    } else {
+        return_val = walk_emit(ctx, task, script_stream);
+    }
+    if (return_val != 0) { // let the others finish (they stop early) before freeing what was not written
+        pthread_mutex_lock(&ctx->lock);
+        walk_set_failure(task, -1);
+        pthread_cond_broadcast(&ctx->cond); // wakes workers waiting for the writer
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pool_destroy(ctx->pool); // the workers have exited, destroying their rings
+    if (ctx->io_uring) { pthread_key_delete(ctx->ring_key); }
+    if (return_val != 0) { walk_task_free(task); }
+    free(ctx->fail_pos);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    return return_val;
+}
+
+int traverse(const char *lower_root, const char *upper_root, FILE* script_stream, TRAVERSE_CALLBACK callback_d, TRAVERSE_CALLBACK callback_dp, TRAVERSE_CALLBACK callback_f, TRAVERSE_CALLBACK callback_sl, TRAVERSE_CALLBACK callback_whiteout, int compare) { // returns 0 on success
+    struct traverse_ctx ctx = {
+        .lower_root_len = strlen(lower_root),
+        .callback_d = callback_d,
+        .callback_dp = callback_dp,
+        .callback_f = callback_f,
+        .callback_sl = callback_sl,
+        .callback_whiteout = callback_whiteout,
+        .merge_join = merge_join,
+        .inode_order = inode_order,
+        .compare = compare,
+        // in parallel, each thread reads a directory and half of the limit is left for the output being buffered
+        .dir_limit = (jobs > 1) ? memory_limit / 2 / (size_t) jobs : memory_limit,
+        .output_limit = memory_limit / 2,
+        .checkpoint = (checkpoint_path != NULL),
+        .inodes = inode_map_new(), // without it, hard links are just compared again
+    };
+    if (compare != COMPARE_NONE && compare_jobs > 1) {
+        ctx.compare_pool = compare_pool_new(compare_jobs, (off_t) split_size);
+        if (ctx.compare_pool == NULL) {
+            fprintf(stderr, "Cannot start the compare threads, comparing large files on one thread.\n");
+        }
+    }
+    if (compare != COMPARE_NONE && lower_manifest != NULL && (ctx.manifest = manifest_open(lower_manifest)) == NULL) {
+        compare_pool_free(ctx.compare_pool);
+        inode_map_free(ctx.inodes);
+        return -1;
+    }
+    struct walker w = { .ctx = &ctx, .out = script_stream, .checkpoint_time = time(NULL) };
+    if (ctx.checkpoint && checkpoint.depth > 0) { w.resume = &checkpoint; }
+    struct traverse_entry root = {
+        .lower_root_len = ctx.lower_root_len,
+        .lower_dirfd = AT_FDCWD,
+        .lower_name = lower_root,
+        .upper_dirfd = AT_FDCWD,
+        .upper_name = upper_root,
+        .upper_fd = -1,
+        .inodes = ctx.inodes,
+        .compare_pool = ctx.compare_pool,
+        .manifest = ctx.manifest,
+    };
+    int return_val = -1;
+    if (use_io_uring) {
+        w.ring = uring_create(RING_SIZE);
+        if (w.ring == NULL) {
+            fprintf(stderr, "io_uring is not available, using plain system calls.\n");
+        }
+        ctx.io_uring = (w.ring != NULL);
+    }
+    if (path_init(&w.lower, lower_root) < 0 || path_init(&w.upper, upper_root) < 0) { goto out; }
+    root.lower_path = w.lower.buf;
+    root.upper_path = w.upper.buf;
+    if (fstatat(AT_FDCWD, upper_root, &root.upper_status, AT_SYMLINK_NOFOLLOW) != 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", upper_root);
+        goto out;
+    }
+    root.upper_type = file_type(&root.upper_status);
+    root.upper_stat_valid = true;
+    if (lookup_lower(&root) < 0) { goto out; }
+    int fts_instr = 0;
+    return_val = 0;
+    if (callback_d != NULL && w.resume == NULL) { // when resuming, it has run before the checkpoint
+        return_val = visit(&w, &root, callback_d, &fts_instr);
+    }
+    if (return_val == 0) {
+        if (fts_instr == TRAVERSE_SKIP) {
+            if (callback_dp != NULL) {
+                return_val = visit(&w, &root, callback_dp, &fts_instr);
             }
+        } else if (jobs > 1) {
+            return_val = traverse_parallel(&ctx, &root, script_stream);
+            if (return_val == 0 && ctx.inodes != NULL) { return_val = inode_map_links(ctx.inodes, relink, script_stream); }
+        } else {
+            return_val = descend(&w, &root);
         }
     }
-    if (errno) { return_val = -1; } // if no error happened, fts_read will "sets the external variable errno to 0" according to the documentation
-    return fts_close(ftsp) || return_val;
+out:
+    if (root.upper_fd >= 0) { close(root.upper_fd); }
+    uring_destroy(w.ring);
+    free(w.levels);
+    inode_map_free(ctx.inodes);
+    compare_pool_free(ctx.compare_pool);
+    manifest_close(ctx.manifest);
+    free(w.lower.buf);
+    free(w.upper.buf);
+    return return_val;
 }
 
-static int deref_d(const char *mnt_path, const char* upper_path, const size_t mnt_root_len, const struct stat *mnt_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int deref_d(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool redirect;
-    if (is_redirect(upper_path, &redirect) < 0) { return -1; }
+    if (is_redirect(e, &redirect) < 0) { return -1; }
     if (!redirect) { return 0; }
-    *fts_instr = FTS_SKIP;
-    return command(script_stream, "rm -rf %U", upper_path) || command(script_stream, "cp -a %M %U", mnt_path, upper_path);
+    *fts_instr = TRAVERSE_SKIP;
+    return command(script_stream, "rm -rf %U", e->upper_path) || command(script_stream, "cp -a %M %U", e->lower_path, e->upper_path);
 }
 
-static int deref_f(const char *mnt_path, const char* upper_path, const size_t mnt_root_len, const struct stat *mnt_status, const struct stat *upper_status, FILE* script_stream, int *fts_instr) {
+static int deref_f(struct traverse_entry *e, FILE* script_stream, int *fts_instr) {
     bool metacopy;
-    if (is_metacopy(upper_path, &metacopy) < 0) { return -1; }
+    if (is_metacopy(e, &metacopy) < 0) { return -1; }
     if (!metacopy) { return 0; }
-    return command(script_stream, "rm -r %U", upper_path) || command(script_stream, "cp -a %M %U", mnt_path, upper_path);
+    return command(script_stream, "rm -r %U", e->upper_path) || command(script_stream, "cp -a %M %U", e->lower_path, e->upper_path);
 }
 
 int vacuum(const char* lowerdir, const char* upperdir, FILE* script_stream) {
-    return traverse(lowerdir, upperdir, script_stream, vacuum_d, vacuum_dp, vacuum_f, vacuum_sl, NULL);
+    return traverse(lowerdir, upperdir, script_stream, vacuum_d, vacuum_dp, vacuum_f, vacuum_sl, NULL, COMPARE_SAME_PERMISSION);
 }
 
 int diff(const char* lowerdir, const char* upperdir) {
-    return traverse(lowerdir, upperdir, NULL, diff_d, NULL, diff_f, diff_sl, diff_whiteout);
+    return traverse(lowerdir, upperdir, stdout, diff_d, NULL, diff_f, diff_sl, diff_whiteout, COMPARE_ALL);
 }
 
 int merge(const char* lowerdir, const char* upperdir, FILE* script_stream) {
-    return traverse(lowerdir, upperdir, script_stream, merge_d, merge_dp, merge_f, merge_sl, merge_whiteout);
+    return traverse(lowerdir, upperdir, script_stream, merge_d, merge_dp, merge_f, merge_sl, merge_whiteout, COMPARE_NONE);
 }
 
 int deref(const char* mountdir, const char* upperdir, FILE* script_stream) {
-    return traverse(mountdir, upperdir, script_stream, deref_d, NULL, deref_f, NULL, NULL);
+    return traverse(mountdir, upperdir, script_stream, deref_d, NULL, deref_f, NULL, NULL, COMPARE_NONE);
 }
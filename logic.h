@@ -8,9 +8,25 @@
 #define OVERLAYFS_TOOLS_LOGIC_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include "checkpoint.h"
 
 extern bool verbose;
 extern bool brief;
+extern int jobs; // number of traversal threads, 1 for the serial traversal
+extern bool use_io_uring; // batch the lookups of each directory through io_uring
+extern bool merge_join; // join sorted upper and lower listings instead of looking up every upper name in lowerdir
+extern bool inode_order; // look up and compare the entries of each directory in on-disk order
+extern size_t memory_limit; // rough ceiling for directory listings and buffered output in bytes, 0 for none
+extern int compare_jobs; // threads comparing ranges of large files, 1 to compare every file on the traversal thread
+extern size_t split_size; // files (or data segments) at least this large are compared by compare_jobs threads
+extern bool digest_cache; // keep the digests of files found identical in xattrs, and compare those next time
+extern const char *lower_manifest; // NULL, or the manifest of lowerdir written by the manifest action
+extern const char *checkpoint_path; // NULL, or where to keep the checkpoint of the action
+extern unsigned checkpoint_interval; // seconds between checkpoints
+extern struct checkpoint checkpoint; // action, directories and output checkpointed. when resuming, the cursor to resume from
+extern volatile sig_atomic_t checkpoint_interrupted; // SIGINT or SIGTERM: checkpoint and stop at the next entry
 
 /*
  * feature function. will take very long time to complete. returns 0 on success
@@ -10,17 +10,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
 #include <errno.h>
+#include <signal.h>
 #ifndef _SYS_STAT_H
   #include <linux/stat.h>
 #endif
 #include "logic.h"
 #include "sh.h"
 #include "common.h"
+#include "manifest.h"
+#include "uncached.h"
+#include "throttle.h"
+#include "execute.h"
 
 #define STRING_BUFFER_SIZE PATH_MAX * 2
 
@@ -29,6 +37,20 @@ bool verbose;
 bool brief;
 bool ignore;
 bool force;
+int jobs = 1;
+bool use_io_uring;
+bool merge_join;
+bool inode_order;
+size_t memory_limit;
+int compare_jobs = 1;
+size_t split_size = (size_t) 1 << 30;
+bool digest_cache;
+const char *lower_manifest;
+const char *checkpoint_path;
+unsigned checkpoint_interval = 60;
+struct checkpoint checkpoint;
+volatile sig_atomic_t checkpoint_interrupted;
+bool resume;
 extern const char *program_name;
 
 #ifndef __GLIBC__
@@ -51,6 +73,7 @@ void print_help(const char *program) {
     puts("  diff   - show the list of actually changed files");
     puts("  merge  - merge all changes from upperdir to lowerdir, and clear upperdir");
     puts("  deref  - copy changes from upperdir to a new upperdir unfolding redirect and metacopy");
+    puts("  manifest - write the manifest of lowerdir to --lower-manifest, for diff and vacuum to compare with");
     puts("");
     puts("Options:");
     puts("  -l, --lowerdir=LOWERDIR    the lowerdir of OverlayFS (required)");
@@ -63,6 +86,35 @@ void print_help(const char *program) {
     puts("  -v, --verbose              with diff action only: when a directory only exists in one version, still list every file of the directory");
     puts("  -V, --version              print project version");
     puts("  -b, --brief                with diff action only: conform to output of diff --brief --recursive --no-dereference");
+    puts("  -j, --jobs=N               traverse upperdir with N threads; output is the same as with a single thread (optional)");
+    puts("      --io-uring             look up the entries of each directory in batches through io_uring (optional)");
+    puts("      --merge-join           read each upperdir directory and its lowerdir counterpart once and join them by name,");
+    puts("                             instead of looking up every name in lowerdir; entries are visited in name order (optional)");
+    puts("      --inode-order          for cold caches: stat the entries of each directory in inode order, and compare");
+    puts("                             regular files in the order of their data on disk (optional)");
+    puts("      --memory-limit=SIZE    keep the memory used for directory listings and buffered output of -j around SIZE");
+    puts("                             bytes (K, M and G suffixes), however wide the directories are (optional)");
+    puts("      --compare-jobs=N       compare the contents of large files in ranges on N threads, whatever the traversal");
+    puts("                             does; the first range found different stops the others (optional)");
+    puts("      --split-size=SIZE      files of at least SIZE bytes (K, M and G suffixes) are compared on --compare-jobs");
+    puts("                             threads, default 1G (optional)");
+    puts("      --digest-cache         store a digest of the upper files found identical in a trusted.overlaytools.digest");
+    puts("                             xattr on them, and skip comparing them next time if neither file has changed in");
+    puts("                             between (optional)");
+    puts("      --lower-manifest=FILE  with diff and vacuum: take the digests of lower files from FILE, written by the");
+    puts("                             manifest action, and only read the upper files (optional)");
+    puts("      --uncached             read file contents with O_DIRECT, or drop them from the page cache after reading,");
+    puts("                             so the page cache of other processes is left alone; the bytes read so are reported");
+    puts("                             (optional)");
+    puts("      --ionice=CLASS         I/O scheduling class: idle, or best-effort:N with N from 0 (highest) to 7 (optional)");
+    puts("      --max-bandwidth=SIZE   read at most SIZE bytes (K, M and G suffixes) of file contents per second (optional)");
+    puts("      --max-iops=N           make at most N reads and lookups per second; the time spent waiting for this");
+    puts("                             budget and --max-bandwidth is reported (optional)");
+    puts("      --checkpoint=FILE      every --checkpoint-interval seconds (default 60) and when interrupted, save how far");
+    puts("                             the action got to FILE; the output of diff must be redirected to a file (optional)");
+    puts("      --checkpoint-interval=SECONDS");
+    puts("                             seconds between checkpoints, 0 to save one after every entry (optional)");
+    puts("      --resume               continue the action from the checkpoint FILE, with the same options (optional)");
     puts("  -h, --help                 show this help text");
     puts("");
     puts("See https://github.com/kmxz/overlayfs-tools/ for warnings and more information.");
@@ -120,6 +172,91 @@ bool directory_exists(const char *path) {
     return (sb.st_mode & S_IFMT) == S_IFDIR;
 }
 
+static void interrupt_handler(int sig) {
+    checkpoint_interrupted = 1;
+}
+
+// cuts output back to where the checkpoint was taken, the rest is produced again
+static bool output_resume(FILE *output) {
+    struct stat st;
+    int fd = fileno(output);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < checkpoint.offset) { return false; }
+    return ftruncate(fd, checkpoint.offset) == 0 && fseeko(output, checkpoint.offset, SEEK_SET) == 0;
+}
+
+// sets up checkpoint for action. when resuming, loads it and checks it is about the same action and directories
+static bool checkpoint_start(const char *action, const char *lower, const char *upper) {
+    if (resume) {
+        if (checkpoint_read(checkpoint_path, &checkpoint) < 0) {
+            fprintf(stderr, "Checkpoint %s cannot be read.\n", checkpoint_path);
+            return false;
+        }
+        if (strcmp(checkpoint.action, action) != 0 || strcmp(checkpoint.lowerdir, lower) != 0 || strcmp(checkpoint.upperdir, upper) != 0
+            || checkpoint.merge_join != merge_join || checkpoint.memory_limit != memory_limit
+            || checkpoint.verbose != verbose || checkpoint.brief != brief) {
+            fprintf(stderr, "Checkpoint %s was taken with another action, other directories or other options.\n", checkpoint_path);
+            return false;
+        }
+        if (strcmp(action, "diff") == 0 && !output_resume(stdout)) {
+            fprintf(stderr, "The output of diff must be redirected with >> to the file it went to before the checkpoint.\n");
+            return false;
+        }
+    } else {
+        checkpoint.action = strdup(action);
+        checkpoint.lowerdir = strdup(lower);
+        checkpoint.upperdir = strdup(upper);
+        checkpoint.output = strdup("-");
+        checkpoint.merge_join = merge_join;
+        checkpoint.memory_limit = memory_limit;
+        checkpoint.verbose = verbose;
+        checkpoint.brief = brief;
+        if (checkpoint.action == NULL || checkpoint.lowerdir == NULL || checkpoint.upperdir == NULL || checkpoint.output == NULL) { return false; }
+        struct stat st;
+        if (strcmp(action, "diff") == 0 && (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode))) {
+            fprintf(stderr, "The output of diff must be redirected to a file to be checkpointed.\n");
+            return false;
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return true;
+}
+
+// the script of action, new or the one of the checkpoint being resumed. *name is set to its name
+static FILE *script_open(char *filename_template, const char **name) {
+    if (checkpoint_path == NULL || !resume) {
+        FILE *script = create_shell_script(filename_template);
+        *name = filename_template;
+        if (script != NULL && checkpoint_path != NULL) {
+            free(checkpoint.output);
+            checkpoint.output = realpath(filename_template, NULL);
+            if (checkpoint.output == NULL) { fclose(script); return NULL; }
+        }
+        return script;
+    }
+    *name = checkpoint.output;
+    FILE *script = fopen(checkpoint.output, "r+");
+    if (script != NULL && !output_resume(script)) {
+        fclose(script);
+        return NULL;
+    }
+    return script;
+}
+
+// a number of threads: a positive decimal number and nothing else
+static bool parse_jobs(const char *str, int *output) {
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno || end == str || *end || value < 1 || value > INT_MAX) { return false; }
+    *output = (int) value;
+    return true;
+}
+
 bool directory_create(const char *name, const char *path) {
     if (mkdir(path, 0755) == 0 || errno == EEXIST) { return true; }
     fprintf(stderr, "%s directory '%s' does not exist and cannot be created.\n", name, path);
@@ -146,6 +283,15 @@ bool check_xattr_trusted(const char *upper) {
     return ret;
 }
 
+void report_io(void) {
+    if (uncached_enabled()) {
+        fprintf(stderr, "%" PRIu64 " bytes of file contents were read without keeping them in the page cache.\n", uncached_bytes());
+    }
+    if (throttle_enabled()) {
+        fprintf(stderr, "Waited %.1f seconds in total to stay within the I/O budget.\n", throttle_waited());
+    }
+}
+
 int main(int argc, char *argv[]) {
 
     char *lower = NULL;
@@ -164,14 +310,31 @@ int main(int argc, char *argv[]) {
         { "verbose",        no_argument      , 0, 'v' },
         { "version",        no_argument      , 0, 'V' },
         { "brief",          no_argument      , 0, 'b' },
+        { "jobs",           required_argument, 0, 'j' },
+        { "io-uring",       no_argument      , 0, 'R' },
+        { "merge-join",     no_argument      , 0, 'J' },
+        { "inode-order",    no_argument      , 0, 'O' },
+        { "memory-limit",   required_argument, 0, 'M' },
+        { "compare-jobs",   required_argument, 0, 'P' },
+        { "split-size",     required_argument, 0, 'Z' },
+        { "digest-cache",   no_argument      , 0, 'D' },
+        { "lower-manifest", required_argument, 0, 'F' },
+        { "uncached",       no_argument      , 0, 'N' },
+        { "ionice",         required_argument, 0, 'E' },
+        { "max-bandwidth",  required_argument, 0, 'W' },
+        { "max-iops",       required_argument, 0, 'Q' },
+        { "checkpoint",     required_argument, 0, 'C' },
+        { "checkpoint-interval", required_argument, 0, 'I' },
+        { "resume",         no_argument      , 0, 'S' },
         { 0,                0,                 0,  0  }
     };
 
+    uint64_t max_bandwidth = 0, max_iops = 0;
     int opt = 0;
     int long_index = 0;
     program_name = basename(argv[0]);
 
-    while ((opt = getopt_long_only(argc, argv, "l:u:m:L:U:ihvVb", long_options, &long_index)) != -1) {
+    while ((opt = getopt_long_only(argc, argv, "l:u:m:L:U:ihvVbj:", long_options, &long_index)) != -1) {
         switch (opt) {
             case 'l':
                 lower = realpath(optarg, NULL);
@@ -212,6 +375,89 @@ int main(int argc, char *argv[]) {
                 verbose = false;
                 brief = true;
                 break;
+            case 'j':
+                if (!parse_jobs(optarg, &jobs)) {
+                    fprintf(stderr, "Invalid number of jobs: %s.\n", optarg);
+                    goto see_help;
+                }
+                break;
+            case 'R':
+                use_io_uring = true;
+                break;
+            case 'J':
+                merge_join = true;
+                break;
+            case 'O':
+                inode_order = true;
+                break;
+            case 'M': {
+                uint64_t size;
+                if (parse_size(optarg, SIZE_MAX, &size) < 0) {
+                    fprintf(stderr, "Invalid memory limit: %s.\n", optarg);
+                    goto see_help;
+                }
+                memory_limit = (size_t) size;
+                break;
+            }
+            case 'P':
+                if (!parse_jobs(optarg, &compare_jobs)) {
+                    fprintf(stderr, "Invalid number of compare jobs: %s.\n", optarg);
+                    goto see_help;
+                }
+                break;
+            case 'Z': {
+                uint64_t size;
+                if (parse_size(optarg, SIZE_MAX, &size) < 0 || size == 0) {
+                    fprintf(stderr, "Invalid split size: %s.\n", optarg);
+                    goto see_help;
+                }
+                split_size = (size_t) size;
+                break;
+            }
+            case 'D':
+                digest_cache = true;
+                break;
+            case 'F':
+                lower_manifest = optarg;
+                break;
+            case 'N':
+                uncached_enable();
+                break;
+            case 'E':
+                if (throttle_ionice(optarg) < 0) {
+                    fprintf(stderr, "I/O scheduling class %s cannot be set: %s.\n", optarg, strerror(errno));
+                    goto see_help;
+                }
+                break;
+            case 'W':
+                if (parse_size(optarg, UINT64_MAX, &max_bandwidth) < 0 || max_bandwidth == 0) {
+                    fprintf(stderr, "Invalid bandwidth: %s.\n", optarg);
+                    goto see_help;
+                }
+                break;
+            case 'Q':
+                if (parse_size(optarg, UINT64_MAX, &max_iops) < 0 || max_iops == 0) {
+                    fprintf(stderr, "Invalid number of I/O requests per second: %s.\n", optarg);
+                    goto see_help;
+                }
+                break;
+            case 'C':
+                checkpoint_path = optarg;
+                break;
+            case 'I': {
+                char *end;
+                errno = 0;
+                unsigned long interval = strtoul(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || *optarg == '-' || interval > UINT_MAX) {
+                    fprintf(stderr, "Invalid checkpoint interval: %s.\n", optarg);
+                    goto see_help;
+                }
+                checkpoint_interval = (unsigned) interval;
+                break;
+            }
+            case 'S':
+                resume = true;
+                break;
             case 'V':
                 version();
                 exit(EXIT_SUCCESS);
@@ -221,6 +467,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    throttle_limit(max_bandwidth, max_iops);
+
     if (!lower) {
         fprintf(stderr, "Lower directory is not specified or doesn't exist.\n");
         goto see_help;
@@ -229,6 +477,20 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Lower directory cannot be opened.\n");
         goto see_help;
     }
+    if (optind == argc - 1 && strcmp(argv[optind], "manifest") == 0) { // the only action without upperdir
+        if (lower_manifest == NULL) {
+            fprintf(stderr, "'manifest' command requires --lower-manifest.\n");
+            goto see_help;
+        }
+        int out = manifest_write(lower, lower_manifest, jobs);
+        report_io();
+        if (out < 0) {
+            fprintf(stderr, "Action aborted due to fatal error.\n");
+            return EXIT_FAILURE;
+        }
+        printf("The manifest %s is created.\n", lower_manifest);
+        return EXIT_SUCCESS;
+    }
     if (!upper) {
         fprintf(stderr, "Upper directory not specified.\n");
         goto see_help;
@@ -246,18 +508,29 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    if (resume && checkpoint_path == NULL) {
+        fprintf(stderr, "--resume requires --checkpoint.\n");
+        goto see_help;
+    }
+    if (checkpoint_path != NULL && jobs > 1) {
+        fprintf(stderr, "--checkpoint cannot be combined with --jobs.\n");
+        goto see_help;
+    }
+
     if (optind == argc - 1) {
         int out;
         char filename_template[] = "overlay-tools-XXXXXX.sh";
+        const char *script_name = NULL;
         FILE *script = NULL;
+        if (checkpoint_path != NULL && !checkpoint_start(argv[optind], lower, upper)) { return EXIT_FAILURE; }
         if (strcmp(argv[optind], "diff") == 0) {
             out = diff(lower, upper);
         } else if (strcmp(argv[optind], "vacuum") == 0) {
-            script = create_shell_script(filename_template);
+            script = script_open(filename_template, &script_name);
             if (script == NULL) { fprintf(stderr, "Script file cannot be created.\n"); return EXIT_FAILURE; }
             out = vacuum(lower, upper, script);
         } else if (strcmp(argv[optind], "merge") == 0) {
-            script = create_shell_script(filename_template);
+            script = script_open(filename_template, &script_name);
             if (script == NULL) { fprintf(stderr, "Script file cannot be created.\n"); return EXIT_FAILURE; }
             out = merge(lower, upper, script);
         } else if (strcmp(argv[optind], "deref") == 0) {
@@ -266,7 +539,7 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "OverlayFS mount directory cannot be opened.\n");
                 goto see_help;
             }
-            script = create_shell_script(filename_template);
+            script = script_open(filename_template, &script_name);
             if (script == NULL) { fprintf(stderr, "Script file cannot be created.\n"); return EXIT_FAILURE; }
             out = deref(mnt, upper, script);
         } else {
@@ -275,28 +548,43 @@ int main(int argc, char *argv[]) {
         }
         if (script != NULL) {
             fclose(script);
-            if (force)
+            if (checkpoint_interrupted)
             {
-                printf("The script %s is created. Running the script now, as force is set to true.\n", filename_template);
-                char *command = malloc(strlen(filename_template) * sizeof(char) + 10);
-                if (command != NULL)
+                printf("The script %s is incomplete. Run again with --resume to complete it.\n", script_name);
+            }
+            else if (force)
+            {
+                printf("The script %s is created. Running the script now, as force is set to true.\n", script_name);
+                fflush(stdout);
+                // the commands are done in this process, unless the script has some execute_script() does not know
+                int failed = execute_script(script_name);
+                if (failed < 0)
+                {
+                    char *command = malloc(strlen(script_name) * sizeof(char) + 10);
+                    if (command != NULL)
+                    {
+                        sprintf(command, "bash %s", script_name);
+                        system(command);
+                        free(command);
+                    }
+                }
+                else if (failed > 0)
                 {
-                    sprintf(command, "bash %s", filename_template);
-                    system(command);
-                    sprintf(command, "rm %s", filename_template);
-                    system(command);
-                    free(command);
+                    fprintf(stderr, "%d commands of the script failed.\n", failed);
                 }
+                unlink(script_name);
             }
             else
             {
-                printf("The script %s is created. Run the script to do the actual work please. Remember to run it when the OverlayFS is not mounted.\n", filename_template);
+                printf("The script %s is created. Run the script to do the actual work please. Remember to run it when the OverlayFS is not mounted.\n", script_name);
             }
         }
+        report_io();
         if (out) {
             fprintf(stderr, "Action aborted due to fatal error.\n");
             return EXIT_FAILURE;
         }
+        if (checkpoint_path != NULL) { unlink(checkpoint_path); } // nothing left to resume
         return EXIT_SUCCESS;
     }
 
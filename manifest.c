@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "manifest.h"
+#include "dir.h"
+#include "pool.h"
+#include "throttle.h"
+
+#define MANIFEST_MAGIC "OVLMANIF"
+#define MANIFEST_VERSION 1
+
+struct manifest_header {
+    char magic[8]; // MANIFEST_MAGIC, without the NUL
+    uint32_t version;
+    uint32_t entry_size; // sizeof(struct manifest_entry), which also tells a manifest of another byte order apart
+    uint64_t count;
+    uint64_t paths_size;
+};
+
+struct manifest {
+    void *map;
+    size_t map_size;
+    const struct manifest_entry *entries;
+    uint64_t count;
+    const char *paths;
+    uint64_t paths_size;
+};
+
+struct builder {
+    const char *lowerdir; // for messages
+    int root_fd;
+    char *path; // of the directory being read, relative to lowerdir
+    size_t path_size;
+    struct manifest_entry *entries;
+    size_t count;
+    size_t size;
+    char *paths;
+    size_t paths_used;
+    size_t paths_size;
+};
+
+struct hash_task {
+    struct builder *b;
+    struct manifest_entry *entry;
+    int error; // errno, if the file could not be read
+};
+
+static int grow(void **array, size_t *size, size_t needed, size_t item_size) {
+    if (needed <= *size) { return 0; }
+    size_t size_new = (*size > 0) ? *size : 256;
+    while (size_new < needed) { size_new *= 2; }
+    void *array_new = realloc(*array, size_new * item_size);
+    if (array_new == NULL) { return -1; }
+    *array = array_new;
+    *size = size_new;
+    return 0;
+}
+
+static int builder_add(struct builder *b, const char *path, const struct stat *status) {
+    size_t len = strlen(path) + 1;
+    if (grow((void **) &b->entries, &b->size, b->count + 1, sizeof(struct manifest_entry)) < 0) { return -1; }
+    if (grow((void **) &b->paths, &b->paths_size, b->paths_used + len, 1) < 0) { return -1; }
+    memcpy(b->paths + b->paths_used, path, len);
+    struct manifest_entry *entry = &b->entries[b->count++];
+    memset(entry, 0, sizeof(struct manifest_entry));
+    entry->path = b->paths_used;
+    entry->ino = status->st_ino;
+    entry->size = status->st_size;
+    entry->mtime_sec = status->st_mtim.tv_sec;
+    entry->mtime_nsec = (uint32_t) status->st_mtim.tv_nsec;
+    entry->ctime_sec = status->st_ctim.tv_sec;
+    entry->ctime_nsec = (uint32_t) status->st_ctim.tv_nsec;
+    entry->mode = status->st_mode;
+    entry->uid = status->st_uid;
+    entry->gid = status->st_gid;
+    b->paths_used += len;
+    return 0;
+}
+
+static bool entry_matches(const struct manifest_entry *entry, const struct stat *status) {
+    return entry->ino == (uint64_t) status->st_ino && entry->size == (int64_t) status->st_size
+        && entry->mtime_sec == (int64_t) status->st_mtim.tv_sec && entry->mtime_nsec == (uint32_t) status->st_mtim.tv_nsec
+        && entry->ctime_sec == (int64_t) status->st_ctim.tv_sec && entry->ctime_nsec == (uint32_t) status->st_ctim.tv_nsec
+        && entry->mode == (uint32_t) status->st_mode && entry->uid == (uint32_t) status->st_uid && entry->gid == (uint32_t) status->st_gid;
+}
+
+// adds the entries under the directory fd (closed here), whose path is the first len bytes of b->path
+static int builder_walk(struct builder *b, int fd, size_t len) {
+    struct dir_stream ds;
+    if (dir_open(&ds, fd) < 0) { return -1; }
+    struct dir_entry ent;
+    int ret;
+    int return_val = 0;
+    while (return_val == 0 && (ret = dir_read(&ds, &ent)) > 0) {
+        size_t name_len = strlen(ent.name);
+        if (grow((void **) &b->path, &b->path_size, len + name_len + 2, 1) < 0) { return_val = -1; break; }
+        b->path[len] = '/';
+        memcpy(b->path + len + 1, ent.name, name_len + 1);
+        struct stat status;
+        throttle(0);
+        if (fstatat(ds.fd, ent.name, &status, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "Failed to stat %s%s.\n", b->lowerdir, b->path);
+            return_val = -1;
+            break;
+        }
+        if (builder_add(b, b->path, &status) < 0) { return_val = -1; break; }
+        if (S_ISDIR(status.st_mode)) {
+            int child = openat(ds.fd, ent.name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child < 0) {
+                fprintf(stderr, "Error occured when opening %s%s.\n", b->lowerdir, b->path);
+                return_val = -1;
+                break;
+            }
+            return_val = builder_walk(b, child, len + 1 + name_len);
+        }
+    }
+    if (return_val == 0 && ret < 0) {
+        b->path[len] = '\0';
+        fprintf(stderr, "Error occured when reading directory %s%s.\n", b->lowerdir, b->path);
+        return_val = -1;
+    }
+    dir_close(&ds);
+    return return_val;
+}
+
+static const char *sort_paths; // qsort() has no argument for it
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp(sort_paths + ((const struct manifest_entry *) a)->path, sort_paths + ((const struct manifest_entry *) b)->path);
+}
+
+// a file changed while it was read is left without a digest: it is just compared as usual
+static void hash_entry(void *arg) {
+    struct hash_task *task = arg;
+    struct manifest_entry *entry = task->entry;
+    int fd = openat(task->b->root_fd, task->b->paths + entry->path + 1, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        task->error = errno;
+        return;
+    }
+    struct stat before, after;
+    unsigned char digest[DIGEST_SIZE];
+    if (fstat(fd, &before) == 0 && entry_matches(entry, &before)) {
+        if (digest_file(fd, digest) != 0) {
+            task->error = errno;
+        } else if (fstat(fd, &after) == 0 && entry_matches(entry, &after)) {
+            memcpy(entry->digest, digest, DIGEST_SIZE);
+            entry->flags |= MANIFEST_DIGEST;
+        }
+    }
+    close(fd);
+}
+
+static int builder_hash(struct builder *b, int nthreads) {
+    struct hash_task *tasks = calloc(b->count, sizeof(struct hash_task));
+    if (tasks == NULL) { return -1; }
+    struct pool *pool = (nthreads > 1) ? pool_create(nthreads) : NULL;
+    for (size_t i = 0; i < b->count; i++) {
+        tasks[i].b = b;
+        tasks[i].entry = &b->entries[i];
+        if (!S_ISREG(b->entries[i].mode)) { continue; }
+        if (pool == NULL || pool_submit(pool, hash_entry, &tasks[i]) < 0) {
+            hash_entry(&tasks[i]);
+        }
+    }
+    if (pool != NULL) { pool_destroy(pool); }
+    int return_val = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (tasks[i].error != 0) {
+            fprintf(stderr, "File %s%s can not be read for content: %s\n", b->lowerdir, b->paths + b->entries[i].path, strerror(tasks[i].error));
+            return_val = -1;
+        }
+    }
+    free(tasks);
+    return return_val;
+}
+
+static int builder_save(const struct builder *b, const char *path) {
+    size_t len = strlen(path);
+    char *tmp_path = malloc(len + 5);
+    if (tmp_path == NULL) { return -1; }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "The manifest %s cannot be created: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+    struct manifest_header header = {
+        .version = MANIFEST_VERSION,
+        .entry_size = sizeof(struct manifest_entry),
+        .count = b->count,
+        .paths_size = b->paths_used,
+    };
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    int return_val = 0;
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+        || fwrite(b->entries, sizeof(struct manifest_entry), b->count, f) != b->count
+        || fwrite(b->paths, 1, b->paths_used, f) != b->paths_used) {
+        return_val = -1;
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) { return_val = -1; }
+    if (fclose(f) != 0) { return_val = -1; }
+    if (return_val == 0 && rename(tmp_path, path) != 0) { return_val = -1; }
+    if (return_val != 0) {
+        fprintf(stderr, "The manifest %s cannot be written.\n", path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return return_val;
+}
+
+int manifest_write(const char *lowerdir, const char *path, int nthreads) {
+    struct builder b = { .lowerdir = lowerdir };
+    b.root_fd = open(lowerdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (b.root_fd < 0) {
+        fprintf(stderr, "Error occured when opening %s.\n", lowerdir);
+        return -1;
+    }
+    int child = dup(b.root_fd);
+    int return_val = (child >= 0) ? builder_walk(&b, child, 0) : -1;
+    if (return_val == 0) {
+        sort_paths = b.paths;
+        qsort(b.entries, b.count, sizeof(struct manifest_entry), entry_cmp);
+        return_val = builder_hash(&b, nthreads);
+    }
+    if (return_val == 0) { return_val = builder_save(&b, path); }
+    close(b.root_fd);
+    free(b.path);
+    free(b.entries);
+    free(b.paths);
+    return return_val;
+}
+
+struct manifest *manifest_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        fprintf(stderr, "The manifest %s cannot be read.\n", path);
+        if (fd >= 0) { close(fd); }
+        return NULL;
+    }
+    struct manifest *m = calloc(1, sizeof(struct manifest));
+    if (m == NULL) { close(fd); return NULL; }
+    m->map_size = (size_t) status.st_size;
+    m->map = (m->map_size >= sizeof(struct manifest_header)) ? mmap(NULL, m->map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (m->map == MAP_FAILED) {
+        fprintf(stderr, "%s is not a manifest.\n", path);
+        free(m);
+        return NULL;
+    }
+    const struct manifest_header *header = m->map;
+    size_t available = m->map_size - sizeof(struct manifest_header);
+    m->count = header->count;
+    m->paths_size = header->paths_size;
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 || header->version != MANIFEST_VERSION
+        || header->entry_size != sizeof(struct manifest_entry) || m->count > available / sizeof(struct manifest_entry)
+        || m->paths_size != available - m->count * sizeof(struct manifest_entry)) {
+        fprintf(stderr, "%s is not a manifest.\n", path);
+        manifest_close(m);
+        return NULL;
+    }
+    m->entries = (const struct manifest_entry *) (header + 1);
+    m->paths = (const char *) (m->entries + m->count);
+    if (m->paths_size > 0 && m->paths[m->paths_size - 1] != '\0') { // so every path ends within the file
+        fprintf(stderr, "%s is not a manifest.\n", path);
+        manifest_close(m);
+        return NULL;
+    }
+    madvise(m->map, m->map_size, MADV_RANDOM);
+    return m;
+}
+
+void manifest_close(struct manifest *m) {
+    if (m == NULL) { return; }
+    munmap(m->map, m->map_size);
+    free(m);
+}
+
+const struct manifest_entry *manifest_find(const struct manifest *m, const char *path, const struct stat *status) {
+    size_t low = 0;
+    size_t high = m->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const struct manifest_entry *entry = &m->entries[mid];
+        if (entry->path >= m->paths_size) { return NULL; } // a damaged manifest
+        int cmp = strcmp(m->paths + entry->path, path);
+        if (cmp == 0) { return entry_matches(entry, status) ? entry : NULL; }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
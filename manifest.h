@@ -0,0 +1,53 @@
+/*
+ * manifest.h / manifest.c
+ *
+ * the manifest of a (read-only) lower layer: every path with its stat keys and, for regular files, the digest of the
+ * contents. one file, used in place through mmap(): a header, the entries sorted by path, then the paths
+ */
+
+#ifndef OVERLAYFS_TOOLS_MANIFEST_H
+#define OVERLAYFS_TOOLS_MANIFEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "digest.h"
+
+enum { MANIFEST_DIGEST = 1 }; // flags of an entry
+
+struct manifest_entry {
+    uint64_t path; // offset of the NUL-terminated path ("/dir/name", as diff prints it) among the paths
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t flags; // MANIFEST_*
+    unsigned char digest[DIGEST_SIZE]; // with MANIFEST_DIGEST
+};
+
+struct manifest;
+
+/*
+ * writes the manifest of the tree at lowerdir to path (through a temporary file renamed over it), hashing the regular
+ * files on nthreads threads. returns 0 on success
+ */
+int manifest_write(const char *lowerdir, const char *path, int nthreads);
+
+/*
+ * maps the manifest at path. returns NULL, with a message printed, if it cannot be read or is not a manifest
+ */
+struct manifest *manifest_open(const char *path);
+
+void manifest_close(struct manifest *m);
+
+/*
+ * the entry of path ("/dir/name") if it is in the manifest and status shows the file unchanged since, otherwise NULL
+ */
+const struct manifest_entry *manifest_find(const struct manifest *m, const char *path, const struct stat *status);
+
+#endif //OVERLAYFS_TOOLS_MANIFEST_H
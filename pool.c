@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define DEQUE_INITIAL_SIZE 64
+
+struct task {
+    POOL_TASK fn;
+    void *arg;
+};
+
+// each worker owns one deque: the owner pushes and pops at the bottom (newest first, so a subtree
+// is finished depth-first by whoever started it), thieves take from the top (the oldest, i.e. biggest, subtrees)
+struct deque {
+    pthread_mutex_t lock;
+    struct task *tasks;
+    size_t size; // capacity, always a power of 2
+    size_t top;
+    size_t bottom;
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+    pthread_t thread;
+    struct deque deque;
+};
+
+struct pool {
+    int nthreads;
+    struct worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; // signalled when a task is queued or the pool is stopping
+    pthread_cond_t done_cond; // signalled when no task is left unfinished
+    size_t queued; // tasks sitting in some deque
+    size_t unfinished; // tasks queued or running
+    bool stop;
+};
+
+static __thread struct worker *current_worker = NULL;
+
+static int deque_init(struct deque *d) {
+    d->tasks = malloc(DEQUE_INITIAL_SIZE * sizeof(struct task));
+    if (d->tasks == NULL) { return -1; }
+    d->size = DEQUE_INITIAL_SIZE;
+    d->top = d->bottom = 0;
+    return pthread_mutex_init(&d->lock, NULL) ? -1 : 0;
+}
+
+static int deque_push(struct deque *d, struct task task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->size) {
+        struct task *grown = malloc(d->size * 2 * sizeof(struct task));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+        for (size_t i = d->top; i != d->bottom; i++) {
+            grown[i & (d->size * 2 - 1)] = d->tasks[i & (d->size - 1)];
+        }
+        free(d->tasks);
+        d->tasks = grown;
+        d->size *= 2;
+    }
+    d->tasks[d->bottom++ & (d->size - 1)] = task;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static bool deque_pop_bottom(struct deque *d, struct task *out) {
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top) {
+        *out = d->tasks[--d->bottom & (d->size - 1)];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool deque_steal_top(struct deque *d, struct task *out) {
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top) {
+        *out = d->tasks[d->top++ & (d->size - 1)];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool find_task(struct worker *self, struct task *out) {
+    struct pool *pool = self->pool;
+    if (deque_pop_bottom(&self->deque, out)) { return true; }
+    for (int i = 1; i < pool->nthreads; i++) {
+        if (deque_steal_top(&pool->workers[(self->id + i) % pool->nthreads].deque, out)) { return true; }
+    }
+    return false;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct pool *pool = self->pool;
+    current_worker = self;
+    for (;;) {
+        struct task task;
+        if (find_task(self, &task)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            task.fn(task.arg);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->unfinished == 0) {
+                pthread_cond_broadcast(&pool->done_cond);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        bool stop = pool->stop && pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) { return NULL; }
+    }
+}
+
+struct pool *pool_create(int nthreads) {
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    if (pool == NULL) { return NULL; }
+    pool->workers = calloc(nthreads, sizeof(struct worker));
+    if (pool->workers == NULL) { free(pool); return NULL; }
+    pool->nthreads = nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (deque_init(&pool->workers[i].deque) < 0) {
+            free(pool->workers[i].deque.tasks);
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&pool->workers[j].deque.lock);
+                free(pool->workers[j].deque.tasks);
+            }
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            // run with the workers we managed to start. the deques of the others are never used
+            for (int j = i; j < nthreads; j++) {
+                pthread_mutex_destroy(&pool->workers[j].deque.lock);
+                free(pool->workers[j].deque.tasks);
+            }
+            if (i == 0) {
+                pthread_mutex_destroy(&pool->lock);
+                pthread_cond_destroy(&pool->work_cond);
+                pthread_cond_destroy(&pool->done_cond);
+                free(pool->workers);
+                free(pool);
+                return NULL;
+            }
+            pool->nthreads = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+int pool_submit(struct pool *pool, POOL_TASK fn, void *arg) {
+    struct task task = { fn, arg };
+    struct worker *target = (current_worker != NULL && current_worker->pool == pool) ? current_worker : &pool->workers[0];
+    // counted before it becomes visible: pool_destroy() cannot return in between, and a thief taking it at once
+    // cannot bring queued below 0
+    pthread_mutex_lock(&pool->lock);
+    pool->unfinished++;
+    pool->queued++;
+    pthread_mutex_unlock(&pool->lock);
+    int return_val = deque_push(&target->deque, task);
+    pthread_mutex_lock(&pool->lock);
+    if (return_val < 0) { // never visible to anyone: uncount it
+        pool->queued--;
+        if (--pool->unfinished == 0) {
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+    } else {
+        pthread_cond_signal(&pool->work_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return return_val;
+}
+
+void pool_destroy(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->unfinished > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,31 @@
+/*
+ * pool.h / pool.c
+ *
+ * a small work-stealing thread pool used by the parallel traversal
+ */
+
+#ifndef OVERLAYFS_TOOLS_POOL_H
+#define OVERLAYFS_TOOLS_POOL_H
+
+typedef void (*POOL_TASK)(void *arg);
+
+struct pool;
+
+/*
+ * start a pool of nthreads workers. returns NULL on failure
+ */
+struct pool *pool_create(int nthreads);
+
+/*
+ * queue a task. called from a worker, the task goes to the bottom of that worker's own deque,
+ * otherwise it goes to the first deque. idle workers steal from the top of other deques.
+ * returns -1 if the deque cannot grow to hold it: the task is not queued then, the caller may run it itself
+ */
+int pool_submit(struct pool *pool, POOL_TASK fn, void *arg);
+
+/*
+ * wait until every queued task (including the ones they queue) has finished, then stop the workers
+ */
+void pool_destroy(struct pool *pool);
+
+#endif //OVERLAYFS_TOOLS_POOL_H
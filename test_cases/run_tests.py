@@ -19,7 +19,33 @@ commands = [
     'ninja verbose.out',
     'ninja overlayed',
     'ninja brief.expected',
-    'ninja brief.out'
+    'ninja brief.out',
+    'ninja jobs.out',
+    'ninja io_uring.out',
+    'ninja merge_join.out',
+    'ninja inode_order.out',
+    'ninja memory_limit.out',
+    'ninja checkpoint.out',
+    'ninja resume.out',
+    'ninja manifest.out',
+    'ninja uncached.out',
+    'ninja throttle.out',
+    'ninja vacuum.out',
+    'ninja hardlinks',
+    'ninja hardlinks.out',
+    'ninja hardlinks_merge.out',
+    'ninja digest.out',
+    'ninja wide',
+    'ninja wide.out',
+    'ninja wide_io_uring.out',
+    'ninja wide_merge_join.out',
+    'ninja wide_inode_order.out',
+    'ninja wide_memory_limit.out',
+    'ninja manifest_stale.out',
+    'ninja uncached_cold.out',
+    'ninja throttle_wait.out',
+    'ninja large',
+    'ninja large.out'
 ]
 
 # Run the commands
@@ -30,3 +56,23 @@ for cmd in commands:
 run_command('diff -u ../test_cases/diff.saved diff.out')
 run_command('diff -u ../test_cases/verbose.saved verbose.out')
 run_command('diff -u brief.expected brief.out')
+run_command('diff -u ../test_cases/diff.saved jobs.out')
+run_command('diff -u ../test_cases/verbose.saved io_uring.out')
+run_command('diff -u ../test_cases/verbose.saved merge_join.out')
+run_command('diff -u ../test_cases/verbose.saved inode_order.out')
+run_command('diff -u ../test_cases/verbose.saved memory_limit.out')
+run_command('diff -u ../test_cases/verbose.saved checkpoint.out')
+run_command('diff -u resume.full resume.out')
+run_command('diff -u ../test_cases/verbose.saved manifest.out')
+run_command('diff -u ../test_cases/verbose.saved uncached.out')
+run_command('diff -u ../test_cases/verbose.saved throttle.out')
+run_command('diff -u ../test_cases/verbose.saved vacuum.out')
+run_command('diff -u ../test_cases/hardlinks.saved hardlinks.out')
+run_command('diff -u ../test_cases/hardlinks_merge.saved hardlinks_merge.out')
+run_command('diff -u ../test_cases/digest.saved digest.out')
+run_command('sort -u wide.out | diff -u ../test_cases/wide.saved -')
+run_command('sort -u wide_merge_join.out | diff -u ../test_cases/wide.saved -')
+run_command('diff -u ../test_cases/manifest_stale.saved manifest_stale.out')
+run_command('diff -u ../test_cases/uncached_cold.saved uncached_cold.out')
+run_command('test ! -s throttle_wait.out')
+run_command('diff -u ../test_cases/large.saved large.out')
@@ -0,0 +1,141 @@
+/*
+ * throttle.c - I/O priority and budget for all utilities
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "throttle.h"
+
+/* From linux/ioprio.h, which older kernel headers do not have */
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT	13
+#endif
+#define IOPRIO_WHO_PROCESS_	1
+#define IOPRIO_CLASS_BE_	2
+#define IOPRIO_CLASS_IDLE_	3
+
+/* Seconds of budget that may be used at once */
+#define THROTTLE_BURST	0.25
+
+/*
+ * One budget as in GCRA: every unit taken moves tat (the time by which
+ * everything taken so far is paid for) interval seconds on, and a request
+ * waits until tat is no more than THROTTLE_BURST ahead of the clock.
+ */
+struct bucket {
+	double interval;	/* seconds per unit, 0 for no limit */
+	double tat;
+};
+
+static bool enabled;
+static struct bucket bytes_bucket, requests_bucket;
+static double waited;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int throttle_ionice(const char *class)
+{
+	int prio_class, data = 4;	/* the kernel's default level */
+	char *end;
+
+	if (strcmp(class, "idle") == 0) {
+		prio_class = IOPRIO_CLASS_IDLE_;
+		data = 0;
+	} else if (strncmp(class, "best-effort", 11) == 0) {
+		prio_class = IOPRIO_CLASS_BE_;
+		if (class[11] == ':') {
+			errno = 0;
+			data = (int)strtol(class + 12, &end, 10);
+			if (errno || end == class + 12 || *end ||
+			    data < 0 || data > 7)
+				goto invalid;
+		} else if (class[11]) {
+			goto invalid;
+		}
+	} else {
+		goto invalid;
+	}
+
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS_, 0,
+		       prio_class << IOPRIO_CLASS_SHIFT | data) ? -1 : 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+void throttle_limit(uint64_t bytes, uint64_t requests)
+{
+	bytes_bucket.interval = bytes ? 1.0 / bytes : 0;
+	requests_bucket.interval = requests ? 1.0 / requests : 0;
+	enabled = bytes || requests;
+}
+
+bool throttle_enabled(void)
+{
+	return enabled;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Take amount units at time t, return how long to wait for them */
+static double bucket_take(struct bucket *b, double amount, double t)
+{
+	if (!b->interval)
+		return 0;
+	if (b->tat < t)
+		b->tat = t;
+	b->tat += amount * b->interval;
+	return b->tat - t - THROTTLE_BURST;
+}
+
+void throttle(uint64_t bytes)
+{
+	struct timespec ts;
+	double t, wait, wait_requests;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&lock);
+	t = now();
+	wait = bucket_take(&bytes_bucket, bytes, t);
+	wait_requests = bucket_take(&requests_bucket, 1, t);
+	if (wait_requests > wait)
+		wait = wait_requests;
+	if (wait > 0)
+		waited += wait;
+	pthread_mutex_unlock(&lock);
+
+	if (wait <= 0)
+		return;
+	ts.tv_sec = (time_t)wait;
+	ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+double throttle_waited(void)
+{
+	double total;
+
+	pthread_mutex_lock(&lock);
+	total = waited;
+	pthread_mutex_unlock(&lock);
+	return total;
+}
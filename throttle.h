@@ -0,0 +1,39 @@
+/*
+ * throttle.h - I/O priority and budget for all utilities
+ *
+ * For running on hosts that serve others at the same time: the I/O
+ * scheduling class of the process (ioprio_set(2)), and a budget of bytes
+ * read and I/O requests per second, kept as a token bucket. The loops
+ * doing the I/O call throttle() before every request, which waits while
+ * the budget is spent.
+ */
+
+#ifndef OVL_THROTTLE_H
+#define OVL_THROTTLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Set the I/O scheduling class of the process (and the threads and
+ * children it starts later) from "idle", "best-effort" or
+ * "best-effort:N", N from 0 (highest) to 7. Returns -1 with errno set if
+ * class is none of these (EINVAL) or the kernel refuses it.
+ */
+int throttle_ionice(const char *class);
+
+/*
+ * Limit I/O to bytes read and requests made per second, 0 for no limit.
+ * Up to a quarter of a second of either may be used at once.
+ */
+void throttle_limit(uint64_t bytes, uint64_t requests);
+
+bool throttle_enabled(void);
+
+/* Account for one I/O request of bytes (0 for metadata), waiting first if over budget */
+void throttle(uint64_t bytes);
+
+/* Seconds spent waiting in throttle() so far, by all threads together */
+double throttle_waited(void);
+
+#endif /* OVL_THROTTLE_H */
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "uncached.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+// pages whose residency is asked for at a time
+#define RESIDENCY_BATCH 1024
+
+static bool enabled;
+static uint64_t bytes_read;
+
+void uncached_enable(void) {
+    enabled = true;
+}
+
+bool uncached_enabled(void) {
+    return enabled;
+}
+
+bool uncached_direct(int fd, bool on) {
+    if (!enabled) { return false; }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) { return false; }
+    bool direct = on && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0; // EINVAL on filesystems without O_DIRECT (tmpfs, ...)
+    if (!direct && (flags & O_DIRECT)) { fcntl(fd, F_SETFL, flags & ~O_DIRECT); }
+    // without O_DIRECT, read-ahead would bring in pages past what is read, which nobody drops
+    posix_fadvise(fd, 0, 0, (on && !direct) ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL);
+    return direct;
+}
+
+// counts the pages of [offset, offset + len) of fd that are in the page cache. false if that cannot be told
+static bool residency(int fd, off_t offset, size_t len, size_t *cached, size_t *total) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~((off_t) page - 1);
+    len += (size_t) (offset - start);
+    unsigned char vec[RESIDENCY_BATCH];
+    *cached = 0;
+    *total = 0;
+    while (len > 0) {
+        size_t n = MIN(len, RESIDENCY_BATCH * page);
+        // mapping faults nothing in, mincore() only looks
+        void *map = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, start);
+        if (map == MAP_FAILED) { return false; }
+        int ret = mincore(map, n, vec);
+        munmap(map, n);
+        if (ret != 0) { return false; }
+        for (size_t i = 0; i < (n + page - 1) / page; i++) {
+            *cached += vec[i] & 1;
+            (*total)++;
+        }
+        start += (off_t) n;
+        len -= n;
+    }
+    return true;
+}
+
+// whether any page of [offset, offset + len) of fd is in the page cache. true when that cannot be told
+static bool range_cached(int fd, off_t offset, size_t len) {
+    size_t cached, total;
+    return !residency(fd, offset, len, &cached, &total) || cached > 0;
+}
+
+bool uncached_resident(int fd, off_t offset, size_t len) {
+    size_t cached, total;
+    return residency(fd, offset, len, &cached, &total) && cached == total;
+}
+
+ssize_t uncached_pread(int fd, void *buf, size_t len, off_t offset) {
+    if (!enabled) { return pread(fd, buf, len, offset); }
+    int flags = fcntl(fd, F_GETFL);
+    bool direct = flags >= 0 && (flags & O_DIRECT);
+    ssize_t ret = 0;
+    if (direct) {
+        ret = pread(fd, buf, len, offset);
+        if (ret < 0 && errno == EINVAL) { // not aligned enough for this filesystem after all
+            direct = false;
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        }
+    }
+    if (!direct) {
+        bool cached = range_cached(fd, offset, len);
+        ret = pread(fd, buf, len, offset);
+        if (ret > 0 && !cached) { // on whole pages, partial ones would be kept
+            off_t page = (off_t) sysconf(_SC_PAGESIZE);
+            off_t start = offset & ~(page - 1);
+            posix_fadvise(fd, start, (offset + ret + page - 1) / page * page - start, POSIX_FADV_DONTNEED);
+        }
+    }
+    if (ret > 0) { uncached_count((uint64_t) ret); }
+    return ret;
+}
+
+bool uncached_bypass(int fd) {
+    if (!enabled) { return true; }
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_DIRECT);
+}
+
+void uncached_count(uint64_t bytes) {
+    if (enabled) { __atomic_fetch_add(&bytes_read, bytes, __ATOMIC_RELAXED); }
+}
+
+uint64_t uncached_bytes(void) {
+    return __atomic_load_n(&bytes_read, __ATOMIC_RELAXED);
+}
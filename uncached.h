@@ -0,0 +1,55 @@
+/*
+ * uncached.h / uncached.c
+ *
+ * reading file contents without leaving them in the page cache, so comparing gigabytes does not evict the working set
+ * of whatever else runs on the host: through O_DIRECT where the filesystem supports it, otherwise by dropping the pages
+ * read afterwards, unless some of them were cached already (and so are likely someone else's)
+ */
+
+#ifndef OVERLAYFS_TOOLS_UNCACHED_H
+#define OVERLAYFS_TOOLS_UNCACHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// what O_DIRECT needs the buffers, offsets and lengths aligned to, on any filesystem this runs on
+#define UNCACHED_ALIGN 4096
+
+/*
+ * turns the mode on, for the rest of the process. until then the functions below are plain pread() and no-ops
+ */
+void uncached_enable(void);
+
+bool uncached_enabled(void);
+
+/*
+ * switches O_DIRECT on fd on or off. returns whether reads of fd now bypass the page cache; if not, they are still
+ * dropped from it after reading, as said above. call with on false before reading fd other than through aligned
+ * buffers, offsets and lengths
+ */
+bool uncached_direct(int fd, bool on);
+
+/*
+ * pread(), counted, and with the pages read dropped from the page cache if need be. with O_DIRECT, buf, len and offset
+ * must be multiples of UNCACHED_ALIGN; a filesystem still refusing the read gets it without O_DIRECT instead
+ */
+ssize_t uncached_pread(int fd, void *buf, size_t len, off_t offset);
+
+/*
+ * whether fd may be read other than through uncached_pread() (with io_uring, say): the mode is off, or fd has O_DIRECT.
+ * the bytes read so are to be added with uncached_count()
+ */
+bool uncached_bypass(int fd);
+
+void uncached_count(uint64_t bytes);
+
+/*
+ * whether all of [offset, offset + len) of fd is in the page cache, mode or not. false if that cannot be told
+ */
+bool uncached_resident(int fd, off_t offset, size_t len);
+
+// the bytes read with the mode on so far
+uint64_t uncached_bytes(void);
+
+#endif //OVERLAYFS_TOOLS_UNCACHED_H
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+struct uring {
+    int fd;
+    bool broken; // a failed submission may have left requests behind: never touch the ring again
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned tail; // our copy of *sq_tail, published by uring_run()
+    unsigned queued; // queued but not yet submitted
+    unsigned inflight; // submitted but not yet completed
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring; // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+struct uring *uring_create(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(SYS_io_uring_setup, entries, &params);
+    if (fd < 0) { return NULL; }
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) { close(fd); return NULL; }
+    ring->fd = fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) { goto fail; }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) { ring->cq_ring = NULL; goto fail; }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) { ring->sqes = NULL; goto fail; }
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->tail = *ring->sq_tail;
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return ring;
+fail:
+    if (ring->sq_ring == MAP_FAILED) { ring->sq_ring = NULL; }
+    uring_destroy(ring);
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring) {
+    if (ring == NULL) { return; }
+    if (ring->sqes != NULL) { munmap(ring->sqes, ring->sqes_size); }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) { munmap(ring->cq_ring, ring->cq_ring_size); }
+    if (ring->sq_ring != NULL) { munmap(ring->sq_ring, ring->sq_ring_size); }
+    close(ring->fd);
+    free(ring);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (ring->broken) { return NULL; }
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->tail - head >= ring->sq_entries) { return NULL; }
+    unsigned index = ring->tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+int uring_statx(struct uring *ring, int dirfd, const char *name, int flags, unsigned mask, struct statx *buf, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) { return -1; }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t) name;
+    sqe->len = mask;
+    sqe->off = (uintptr_t) buf;
+    sqe->statx_flags = (unsigned) flags;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_getxattr(struct uring *ring, const char *path, const char *name, void *value, size_t size, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) { return -1; }
+    sqe->opcode = IORING_OP_GETXATTR;
+    sqe->addr = (uintptr_t) name;
+    sqe->addr2 = (uintptr_t) value;
+    sqe->addr3 = (uintptr_t) path;
+    sqe->len = (unsigned) size;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) { return -1; }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (unsigned) len;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_wait(struct uring *ring, unsigned min, URING_COMPLETE complete, void *arg) {
+    if (ring->broken) { return -1; }
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->queued;
+    ring->queued = 0;
+    int return_val = 0;
+    for (;;) {
+        min = MIN(min, ring->inflight + to_submit);
+        if (to_submit == 0 && min == 0) { break; }
+        unsigned wait = (min > 0) ? 1 : 0;
+        int ret = (int) syscall(SYS_io_uring_enter, ring->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret < 0 && to_submit == 0 && (errno == EAGAIN || errno == EBUSY)) { continue; } // only waiting: try again
+        if (ret < 0 || (ret == 0 && wait == 0)) { // failed, or the kernel took nothing to submit
+            ring->broken = true;
+            return_val = -1;
+            if (to_submit == 0 || ring->inflight == 0) { break; } // cannot wait, or nothing left to wait for
+            to_submit = 0; // only wait for what was submitted already
+            min = ring->inflight;
+            continue;
+        }
+        to_submit -= (unsigned) ret;
+        ring->inflight += (unsigned) ret;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            if (return_val == 0) { complete(arg, cqe->user_data, cqe->res); }
+            ring->inflight--;
+            if (min > 0) { min--; }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return return_val;
+}
+
+int uring_run(struct uring *ring, URING_COMPLETE complete, void *arg) {
+    return uring_wait(ring, UINT_MAX, complete, arg);
+}
+
+#else
+
+struct uring *uring_create(unsigned entries) { return NULL; }
+void uring_destroy(struct uring *ring) {}
+int uring_statx(struct uring *ring, int dirfd, const char *name, int flags, unsigned mask, struct statx *buf, uint64_t user_data) { return -1; }
+int uring_getxattr(struct uring *ring, const char *path, const char *name, void *value, size_t size, uint64_t user_data) { return -1; }
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t user_data) { return -1; }
+int uring_wait(struct uring *ring, unsigned min, URING_COMPLETE complete, void *arg) { return -1; }
+int uring_run(struct uring *ring, URING_COMPLETE complete, void *arg) { return -1; }
+
+#endif
+
+void statx_to_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = (off_t) stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t) stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
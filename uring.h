@@ -0,0 +1,52 @@
+/*
+ * uring.h / uring.c
+ *
+ * a minimal io_uring wrapper (no liburing) used to batch the stat and xattr lookups of the traversal, and to keep the
+ * reads of both files in flight while comparing
+ */
+
+#ifndef OVERLAYFS_TOOLS_URING_H
+#define OVERLAYFS_TOOLS_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef void (*URING_COMPLETE)(void *arg, uint64_t user_data, int res);
+
+struct uring;
+
+/*
+ * set up a ring with room for at least entries queued requests. returns NULL if io_uring is not available
+ * (not compiled in, old kernel, or forbidden by a seccomp filter)
+ */
+struct uring *uring_create(unsigned entries);
+
+void uring_destroy(struct uring *ring);
+
+/*
+ * queue a statx(2), a path based getxattr(2) or a pread(2). the arguments must stay valid until the request has
+ * completed. returns -1 if the ring is full or unusable
+ */
+int uring_statx(struct uring *ring, int dirfd, const char *name, int flags, unsigned mask, struct statx *buf, uint64_t user_data);
+int uring_getxattr(struct uring *ring, const char *path, const char *name, void *value, size_t size, uint64_t user_data);
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t user_data);
+
+/*
+ * submit everything queued and wait for all of it. complete() is called once per request with its result
+ * (the syscall return value, or -errno). returns -1 if the ring failed; it is unusable afterwards. the requests it had
+ * submitted are still waited for then (without calling complete()), so their buffers can be freed
+ */
+int uring_run(struct uring *ring, URING_COMPLETE complete, void *arg);
+
+/*
+ * submit everything queued, and wait until at least min of the requests in flight (queued now or before) have
+ * completed. complete() is called as in uring_run(), for every request found completed meanwhile. returns -1 if the
+ * ring failed, as uring_run() does
+ */
+int uring_wait(struct uring *ring, unsigned min, URING_COMPLETE complete, void *arg);
+
+void statx_to_stat(const struct statx *stx, struct stat *st);
+
+#endif //OVERLAYFS_TOOLS_URING_H